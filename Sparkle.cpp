@@ -8,6 +8,67 @@
 
 #include "Sparkle.h"
 
+/**
+ * Stamps the feature set this library was built with; see
+ * SparkleFeatureSet.
+ */
+void sparkleFeatureCheck(SparkleFeatureSet<SPARKLE_FEATURES>) {
+}
+
+#ifdef __LED_FADE_ENABLED__
+/**
+ * Gamma correction (2.8) from linear fade level to PWM duty, kept in flash.
+ */
+static const unsigned char sparkleGamma[256] PROGMEM = {
+    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   1,   1,   1,   1,
+    1,   1,   1,   1,   1,   1,   1,   1,   1,   2,   2,   2,   2,   2,   2,   2,
+    2,   3,   3,   3,   3,   3,   3,   3,   4,   4,   4,   4,   4,   5,   5,   5,
+    5,   6,   6,   6,   6,   7,   7,   7,   7,   8,   8,   8,   9,   9,   9,  10,
+   10,  10,  11,  11,  11,  12,  12,  13,  13,  13,  14,  14,  15,  15,  16,  16,
+   17,  17,  18,  18,  19,  19,  20,  20,  21,  21,  22,  22,  23,  24,  24,  25,
+   25,  26,  27,  27,  28,  29,  29,  30,  31,  32,  32,  33,  34,  35,  35,  36,
+   37,  38,  39,  39,  40,  41,  42,  43,  44,  45,  46,  47,  48,  49,  50,  50,
+   51,  52,  54,  55,  56,  57,  58,  59,  60,  61,  62,  63,  64,  66,  67,  68,
+   69,  70,  72,  73,  74,  75,  77,  78,  79,  81,  82,  83,  85,  86,  87,  89,
+   90,  92,  93,  95,  96,  98,  99, 101, 102, 104, 105, 107, 109, 110, 112, 114,
+  115, 117, 119, 120, 122, 124, 126, 127, 129, 131, 133, 135, 137, 138, 140, 142,
+  144, 146, 148, 150, 152, 154, 156, 158, 160, 162, 164, 167, 169, 171, 173, 175,
+  177, 180, 182, 184, 186, 189, 191, 193, 196, 198, 200, 203, 205, 208, 210, 213,
+  215, 218, 220, 223, 225, 228, 231, 233, 236, 239, 241, 244, 247, 249, 252, 255
+};
+#endif
+
+#ifdef __USE_SPARKLE__
+/**
+ * The color of each LedColor on a pixel backend, as red, green and blue, kept
+ * in flash. IR doesn't show.
+ */
+static const unsigned char sparkleColorRgb[SPARKLE_COLORS][3] PROGMEM = {
+  {255, 255, 255},  // ANY
+  {  0,   0,   0},  // IR
+  {255,   0,   0},  // RED
+  {255,  64,   0},  // ORANGE
+  {255, 160,   0},  // YELLOW
+  {  0, 255,   0},  // GREEN
+  {  0, 255, 255},  // AQUA
+  {  0,   0, 255},  // BLUE
+  {128,   0, 255},  // PURPLE
+  { 64,   0, 255},  // UV
+  {255, 255, 255}   // WHITE
+};
+#endif
+
+#ifdef __LED_SEQUENCE_ENABLED__
+/**
+ * The 16-bit argument of a sequence instruction, low byte first. Read a byte
+ * at a time, as it need not be aligned.
+ */
+static unsigned short sequenceWord(const unsigned char *at) {
+  return pgm_read_byte(at) | ((unsigned short)pgm_read_byte(at + 1) << 8);
+}
+#endif
+
 // LedDef Class //////////////////////////////////////////////////////////////////
 
   /**
@@ -15,41 +76,470 @@
    */
   void LedDef::initPin() {
     pinMode(pin, OUTPUT);
-    turnOff();
+    if (rgb) {
+      pinMode(static_cast<RgbLedDef *>(this)->greenPin, OUTPUT);
+      pinMode(static_cast<RgbLedDef *>(this)->bluePin, OUTPUT);
+    }
+    reset();
+  }
+
+  /**
+   * Turn off in MANUAL mode, writing the output even if the LED already
+   * seems off: at start up its real level is unknown.
+   */
+  void LedDef::reset() {
+    ledIsOn = false;
+    displayMode = MANUAL;
+    write();
+  }
+
+#ifdef __USE_SPARKLE__
+  /**
+   * Bytes of the LED's record in a Sparkle::saveState() blob.
+   */
+  unsigned char LedDef::stateBytes() {
+    unsigned char bytes = 2;
+#ifdef __LED_BLINK_ENABLED__
+    bytes += 4;
+#endif
+#ifdef __LED_TIMED_ENABLED__
+    bytes += 2;
+#endif
+#ifdef __LED_BLINK_RANDOM_ENABLED__
+    bytes += 10;
+#endif
+#ifdef __LED_FADE_ENABLED__
+    bytes += 8;
+#endif
+    return rgb?bytes + 3:bytes;
+  }
+
+#if defined(__LED_BLINK_ENABLED__) || defined(__LED_TIMED_ENABLED__) || \
+    defined(__LED_BLINK_RANDOM_ENABLED__) || defined(__LED_FADE_ENABLED__)
+  /**
+   * Write a 16-bit value at at, low byte first, and move at past it; or read
+   * one back.
+   */
+  static void saveWord(unsigned char *&at, unsigned short value) {
+    *at++ = value;
+    *at++ = value >> 8;
+  }
+
+  static unsigned short loadWord(const unsigned char *&at) {
+    unsigned short value = at[0] | ((unsigned short)at[1] << 8);
+    at += 2;
+    return value;
+  }
+#endif
+
+  /**
+   * Write the LED's record at at and move at past it. Sequences and groups
+   * are saved as MANUAL, as they live outside the LED.
+   */
+  void LedDef::saveState(unsigned char *&at) {
+    unsigned char mode = displayMode;
+#ifdef __LED_SEQUENCE_ENABLED__
+    if (mode == SEQUENCE) {
+      mode = MANUAL;
+    }
+#endif
+#ifdef __SPARKLE_GROUP_ENABLED__
+    if (mode == GROUPED) {
+      mode = MANUAL;
+    }
+#endif
+    *at++ = mode;
+    unsigned char flags = ledIsOn?1:0;
+#ifdef __LED_FADE_ENABLED__
+    if (fadingUp) {
+      flags |= 2;
+    }
+#endif
+    *at++ = flags;
+#ifdef __LED_BLINK_ENABLED__
+    saveWord(at, blinkOnDuration);
+    saveWord(at, blinkOffDuration);
+#endif
+#ifdef __LED_TIMED_ENABLED__
+    saveWord(at, timerDuration);
+#endif
+#ifdef __LED_BLINK_RANDOM_ENABLED__
+    saveWord(at, randMinOffDuration);
+    saveWord(at, randMaxOffDuration);
+    saveWord(at, randMinOnDuration);
+    saveWord(at, randMaxOnDuration);
+    saveWord(at, randDuration);
+#endif
+#ifdef __LED_FADE_ENABLED__
+    *at++ = fadeMin;
+    *at++ = fadeMax;
+    saveWord(at, fadeUpStep);
+    saveWord(at, fadeDownStep);
+    saveWord(at, level);
+#endif
+    if (rgb) {
+      RgbLedDef *c = static_cast<RgbLedDef *>(this);
+      *at++ = c->red;
+      *at++ = c->green;
+      *at++ = c->blue;
+    }
+  }
+
+  /**
+   * Read the LED's record at at and move at past it.
+   */
+  void LedDef::loadState(const unsigned char *&at) {
+    displayMode = (enum DisplayMode)*at++;
+    unsigned char flags = *at++;
+    ledIsOn = flags & 1;
+#ifdef __LED_FADE_ENABLED__
+    fadingUp = flags & 2;
+#endif
+#ifdef __LED_BLINK_ENABLED__
+    blinkOnDuration = loadWord(at);
+    blinkOffDuration = loadWord(at);
+#endif
+#ifdef __LED_TIMED_ENABLED__
+    timerDuration = loadWord(at);
+#endif
+#ifdef __LED_BLINK_RANDOM_ENABLED__
+    randMinOffDuration = loadWord(at);
+    randMaxOffDuration = loadWord(at);
+    randMinOnDuration = loadWord(at);
+    randMaxOnDuration = loadWord(at);
+    randDuration = loadWord(at);
+#endif
+#ifdef __LED_FADE_ENABLED__
+    fadeMin = *at++;
+    fadeMax = *at++;
+    fadeUpStep = loadWord(at);
+    fadeDownStep = loadWord(at);
+    level = loadWord(at);
+#endif
+    if (rgb) {
+      RgbLedDef *c = static_cast<RgbLedDef *>(this);
+      c->red = *at++;
+      c->green = *at++;
+      c->blue = *at++;
+    }
+  }
+
+  /**
+   * Make the pins that Sparkle doesn't batch outputs, and show the loaded
+   * state: through the shadow ports for batched pins.
+   */
+  void LedDef::restore() {
+    if (!owner->frame) {
+#ifdef SPARKLE_PORT_IO
+      if (port == SPARKLE_NO_PORT) {
+        pinMode(pin, OUTPUT);
+      }
+      if (rgb) {
+        RgbLedDef *c = static_cast<RgbLedDef *>(this);
+        if (c->greenPort == SPARKLE_NO_PORT) {
+          pinMode(c->greenPin, OUTPUT);
+        }
+        if (c->bluePort == SPARKLE_NO_PORT) {
+          pinMode(c->bluePin, OUTPUT);
+        }
+      }
+#else
+      pinMode(pin, OUTPUT);
+      if (rgb) {
+        pinMode(static_cast<RgbLedDef *>(this)->greenPin, OUTPUT);
+        pinMode(static_cast<RgbLedDef *>(this)->bluePin, OUTPUT);
+      }
+#endif
+    }
+#ifdef __LED_FADE_ENABLED__
+    if (isFading() && canFade()) {
+      writeLevel();
+      return;
+    }
+#endif
+    write();
+  }
+#endif
+
+  /**
+   * Drive the pin to match ledIsOn. LEDs that Sparkle has grouped by port go
+   * through its shadow port, LEDs on a frame backend set their frame bit, and
+   * everything else uses digitalWrite().
+   */
+  void LedDef::write() {
+    if (rgb) {
+      static_cast<RgbLedDef *>(this)->writeRgb(ledIsOn?dim(255):0);
+      return;
+    }
+#ifdef __USE_SPARKLE__
+    if (owner && owner->frame) {
+      if (owner->frame->pixels) {
+        owner->writePixel(*this, ledIsOn?dim(255):0);
+      } else {
+        owner->writeFrame(*this);
+      }
+      return;
+    }
+#endif
+#ifdef SPARKLE_PORT_IO
+    if (port != SPARKLE_NO_PORT) {
+      owner->writePort(port, bit, ledIsOn);
+#ifdef __LED_FADE_ENABLED__
+      if (!isFading() || !usesAnalog()) {
+        return;
+      }
+#else
+      return;
+#endif
+      // Leaving FADE: digitalWrite() also takes the pin off its PWM timer.
+    }
+#endif
+    digitalWrite(pin, (ledIsOn == commonCathode)?HIGH:LOW);
+  }
+
+  /**
+   * Get the time of the LED's next scheduled change. Returns false if it has
+   * nothing scheduled (e.g. MANUAL mode).
+   */
+  bool LedDef::nextEvent(unsigned long &due) {
+    (void)due;
+    switch (displayMode) {
+#ifdef __LED_BLINK_ENABLED__
+      case BLINK:
+        due = lastTime + (ledIsOn?blinkOnDuration:blinkOffDuration);
+        return true;
+#endif
+
+#ifdef __LED_BLINK_RANDOM_ENABLED__
+      case BLINK_RANDOM:
+        due = lastTime + randDuration;
+        return true;
+#endif
+
+#ifdef __LED_TIMED_ENABLED__
+      case TIMED:
+        due = lastTime + timerDuration;
+        return ledIsOn;
+#endif
+
+#ifdef __LED_FADE_ENABLED__
+      case FADE:
+        due = lastTime + frameTicks();
+        return true;
+#endif
+
+#ifdef __LED_SEQUENCE_ENABLED__
+      case SEQUENCE:
+        switch (pgm_read_byte(sequence + pc)) {
+          case SPARKLE_SEQ_HOLD:
+            due = lastTime + sequenceWord(sequence + pc + 1);
+            return true;
+          case SPARKLE_SEQ_RAMP:
+            due = lastTime + frameTicks();
+            return true;
+          default:
+            return false;
+        }
+#endif
+
+      default:
+        return false;
+    }
+  }
+
+  /**
+   * Current time on the owning Sparkle's timebase, or millis() for a
+   * standalone LED.
+   */
+  unsigned long LedDef::currentTime() {
+#ifdef __USE_SPARKLE__
+    if (owner) {
+      return owner->now();
+    }
+#endif
+    return millis();
+  }
+
+  /**
+   * Shortest time between two level changes: the owning Sparkle's frame
+   * interval, or 1 tick for a standalone LED.
+   */
+  unsigned short LedDef::frameTicks() {
+#ifdef __USE_SPARKLE__
+    if (owner) {
+      return owner->frameInterval;
+    }
+#endif
+    return 1;
+  }
+
+  /**
+   * Scale a PWM duty by the owning Sparkle's global brightness.
+   */
+  unsigned char LedDef::dim(unsigned char duty) {
+#ifdef __USE_SPARKLE__
+    if (owner) {
+      return owner->dim(duty);
+    }
+#endif
+    return duty;
+  }
+
+  /**
+   * Tell the owning Sparkle (if any) that the schedule changed.
+   */
+  void LedDef::reschedule() {
+#ifdef __USE_SPARKLE__
+    if (owner) {
+      owner->schedule(*this);
+    }
+#endif
+  }
+
+  /**
+   * A random duration from min up to, but not including, max. Uses the
+   * owning Sparkle's generator, or random() for a standalone LED.
+   */
+#ifdef __LED_BLINK_RANDOM_ENABLED__
+  unsigned short LedDef::randomBetween(unsigned short min, unsigned short max) {
+#ifdef __USE_SPARKLE__
+    if (owner) {
+      return owner->rng.between(min, max);
+    }
+#endif
+    return random(min, max);
+  }
+#endif
+
+  /**
+   * Count an on() or off() in the owner's stats: written or suppressed, and
+   * whether the LED changed state (under the mode it was in).
+   */
+#if defined(__USE_SPARKLE__) && defined(__SPARKLE_STATS_ENABLED__)
+  void LedDef::countWrite(bool written, bool changed) {
+    if (owner) {
+      if (written) {
+        owner->stats.writes++;
+      } else {
+        owner->stats.suppressed++;
+      }
+      if (changed) {
+        owner->stats.transitions[displayMode]++;
+      }
+    }
+  }
+#endif
+
+  /**
+   * Note an on() or off() for the owner's listener. Only the state before
+   * the first change of a hold is kept.
+   */
+#ifdef __USE_SPARKLE__
+  void LedDef::noteEvent(bool wasOn) {
+    if (owner && owner->listener && !eventPending) {
+      eventPending = true;
+      eventWasOn = wasOn;
+      owner->queueEvent(*this);
+    }
+  }
+#endif
+
+  /**
+   * Set whether the LED is on without writing it, noting a change for the
+   * listener.
+   */
+  void LedDef::setLit(bool lit) {
+#ifdef __USE_SPARKLE__
+    if (ledIsOn != lit) {
+      noteEvent(ledIsOn);
+    }
+#endif
+    ledIsOn = lit;
+  }
+
+  /**
+   * Hold the owner's output around a public call, and end the hold.
+   */
+  void LedDef::holdOwner() {
+#ifdef __USE_SPARKLE__
+    if (owner) {
+      owner->hold();
+    }
+#endif
+  }
+
+  void LedDef::commitOwner() {
+#ifdef __USE_SPARKLE__
+    if (owner) {
+      owner->commit();
+    }
+#endif
   }
 
   /**
    * Turn off the LED. Pay attention to whether it is common cathode or anode.
+   * Nothing is written if the LED is already off.
    * For internal class use only. Public method is turnOff().
    */
   void LedDef::off() {
-    digitalWrite(pin, (commonCathode?LOW:HIGH));
-    ledIsOn = false;
+#if defined(__USE_SPARKLE__) && defined(__SPARKLE_STATS_ENABLED__)
+    countWrite(ledIsOn || isFading(), ledIsOn);
+#endif
+    if (ledIsOn || isFading()) {
+      bool changed = ledIsOn;
+      ledIsOn = false;
+      write();
+#ifdef __USE_SPARKLE__
+      if (changed) {
+        noteEvent(true);
+      }
+#else
+      (void)changed;
+#endif
+    }
   }
 
   /**
    * Turn off the LED.
    */
   void LedDef::turnOff() {
+    holdOwner();
     off();
     displayMode = MANUAL;
+    commitOwner();
   }
 
   /**
    * Turn on the LED. Pay attention to whether it is common cathode or anode.
+   * Nothing is written if the LED is already on.
    * For internal class use only. Public method is turnOn().
    */
   void LedDef::on() {
-    digitalWrite(pin, (commonCathode?HIGH:LOW));
-    ledIsOn = true;
+#if defined(__USE_SPARKLE__) && defined(__SPARKLE_STATS_ENABLED__)
+    countWrite(!ledIsOn || isFading(), !ledIsOn);
+#endif
+    if (!ledIsOn || isFading()) {
+      bool changed = !ledIsOn;
+      ledIsOn = true;
+      write();
+#ifdef __USE_SPARKLE__
+      if (changed) {
+        noteEvent(false);
+      }
+#else
+      (void)changed;
+#endif
+    }
   }
 
   /**
    * Turn on the LED. Pay attention to whether it is common cathode or anode.
    */
   void LedDef::turnOn() {
+    holdOwner();
     on();
     displayMode = MANUAL;
+    commitOwner();
   }
 
   /**
@@ -69,7 +559,8 @@
   /**
    * Set the blink mode with the duration on and off.
    * This does not change the mode to BLINK from MANUAL or any other mode. To
-   * do that, call startBlink().
+   * do that, call startBlink(). A blinking LED uses the new durations from
+   * its current on or off period.
    * If onDuration or offDuration are zero, both settings are ignored.
    */
 #ifdef __LED_BLINK_ENABLED__
@@ -77,6 +568,9 @@
     if ((onDuration > 0) && (offDuration > 0)) {
       blinkOnDuration = onDuration;
       blinkOffDuration = offDuration;
+      if (displayMode == BLINK) {
+        reschedule();
+      }
     }
   }
 #endif
@@ -89,9 +583,12 @@
 #ifdef __LED_BLINK_ENABLED__
   void LedDef::startBlink() {
     if ((blinkOnDuration > 0) && (blinkOffDuration > 0)) {
+      holdOwner();
       on();
-      lastTime = millis();
+      lastTime = currentTime();
       displayMode = BLINK;
+      reschedule();
+      commitOwner();
     }
   }
 #endif
@@ -126,17 +623,20 @@
   void LedDef::startRandomBlink() {
     if ((randMinOffDuration > 0) && (randMaxOffDuration > 0) &&
         (randMinOnDuration > 0) && (randMaxOnDuration > 0)) {
+      holdOwner();
       // Don't just automatically start with the LED on as in other modes,
       // as this is a random blink pattern...
-      if (random(2)) {
+      if (randomBetween(0, 2)) {
         on();
-        randOnDuration = random(randMinOnDuration, randMaxOnDuration);
+        randDuration = randomBetween(randMinOnDuration, randMaxOnDuration);
       } else {
         off();
-        randOffDuration = random(randMinOffDuration, randMaxOffDuration);
+        randDuration = randomBetween(randMinOffDuration, randMaxOffDuration);
       }
-      lastTime = millis();
+      lastTime = currentTime();
       displayMode = BLINK_RANDOM;
+      reschedule();
+      commitOwner();
     }
   }
 #endif
@@ -144,13 +644,17 @@
   /**
    * Set the time'd LED's duration.
    * This does not change the mode to TIMED from MANUAL or any other mode. To
-   * do that, call startTimer().
+   * do that, call startTimer(). A running timer ends duration after it
+   * was started.
    * If duration is zero, the setting is ignored.
    */
 #ifdef __LED_TIMED_ENABLED__
   void LedDef::setTimer(unsigned short duration) {
     if (duration > 0) {
       timerDuration = duration;
+      if (displayMode == TIMED) {
+        reschedule();
+      }
     }
   }
 #endif
@@ -163,140 +667,1341 @@
 #ifdef __LED_TIMED_ENABLED__
   void LedDef::startTimer() {
     if (timerDuration > 0) {
+      holdOwner();
       on();
-      lastTime = millis();
+      lastTime = currentTime();
       displayMode = TIMED;
+      reschedule();
+      commitOwner();
     }
   }
 #endif
 
   /**
-   * Call periodically to update the state.
+   * Set the fade mode: the brightness range (0-255) and the time in
+   * milliseconds to fade up and back down.
+   * This does not change the mode to FADE from MANUAL or any other mode. To
+   * do that, call startFade().
+   * If upDuration or downDuration are zero, or minLevel isn't below maxLevel,
+   * all settings are ignored.
    */
-  void LedDef::update() {
-    unsigned long now=0;
-
-    switch (displayMode) {
-#ifdef __LED_BLINK_ENABLED__
-      case BLINK:
-        now = millis();
-        if (ledIsOn) {
-          // LED is currently on. See if on duration has expired.
-          if (now >= (lastTime + blinkOnDuration)) {
-            off();
-            lastTime = now;
-          }
-        } else {
-          // LED is currently off. See if off duration has expired.
-          if (now >= (lastTime + blinkOffDuration)) {
-            on();
-            lastTime = now;
-          }
-        }
-        break;
+#ifdef __LED_FADE_ENABLED__
+  void LedDef::setFade(unsigned char minLevel, unsigned char maxLevel,
+                       unsigned short upDuration, unsigned short downDuration) {
+    if ((upDuration > 0) && (downDuration > 0) && (minLevel < maxLevel)) {
+      // Work out the per-tick steps once, so update() never divides.
+      unsigned short range = (unsigned short)(maxLevel - minLevel) << 8;
+      fadeMin = minLevel;
+      fadeMax = maxLevel;
+      fadeUpStep = range / upDuration;
+      fadeDownStep = range / downDuration;
+      if (fadeUpStep == 0) {
+        fadeUpStep = 1;
+      }
+      if (fadeDownStep == 0) {
+        fadeDownStep = 1;
+      }
+    }
+  }
 #endif
 
-#ifdef __LED_BLINK_RANDOM_ENABLED__
-      case BLINK_RANDOM:
-        now = millis();
-        if (ledIsOn) {
-          // LED is currently on. See if on duration has expired.
-          if (now >= (lastTime + randOnDuration)) {
-            off();
-            lastTime = now;
-            randOffDuration = random(randMinOffDuration, randMaxOffDuration);
-          }
-        } else {
-          // LED is currently off. See if off duration has expired.
-          if (now >= (lastTime + randOffDuration)) {
-            on();
-            lastTime = now;
-            randOnDuration = random(randMinOnDuration, randMaxOnDuration);
+  /**
+   * Start fading up and down continuously, using the parameters set by
+   * setFade(). Only PWM capable pins can fade.
+   * If setFade() wasn't called to initialize the fade, then startFade()
+   * doesn't do anything.
+   */
+#ifdef __LED_FADE_ENABLED__
+  void LedDef::startFade() {
+    if (canFade() && (fadeUpStep > 0) && (fadeDownStep > 0)) {
+      holdOwner();
+      setLit(true);
+      level = (unsigned short)fadeMin << 8;
+      fadingUp = true;
+      lastTime = currentTime();
+      displayMode = FADE;
+      writeLevel();
+      reschedule();
+      commitOwner();
+    }
+  }
+
+  /**
+   * Output the current fade level, gamma corrected.
+   */
+  void LedDef::writeLevel() {
+    unsigned char duty = dim(pgm_read_byte(&sparkleGamma[level >> 8]));
+#if defined(__USE_SPARKLE__) && defined(__SPARKLE_STATS_ENABLED__)
+    if (owner) {
+      owner->stats.writes++;
+    }
+#endif
+#ifdef __USE_SPARKLE__
+    if (owner && owner->frame) {
+      owner->writePixel(*this, duty);
+      return;
+    }
+#endif
+    if (rgb) {
+      static_cast<RgbLedDef *>(this)->writeRgb(duty);
+      return;
+    }
+#ifdef SPARKLE_PORT_IO
+    if (!usesAnalog()) {
+      owner->writePortLevel(port, bit, duty);
+      return;
+    }
+#endif
+    analogWrite(pin, commonCathode?duty:(255 - duty));
+  }
+
+  /**
+   * Whether the LED fades with analogWrite(), as opposed to software PWM.
+   */
+  bool LedDef::usesAnalog() {
+#ifdef __USE_SPARKLE__
+    if (owner && owner->frame && owner->frame->pixels) {
+      return false;
+    }
+#endif
+#ifdef SPARKLE_PORT_IO
+    return (port == SPARKLE_NO_PORT) || !owner->bamPlanes;
+#else
+    return true;
+#endif
+  }
+#endif
+
+  /**
+   * Play a PROGMEM pattern. phase starts the pattern that many ticks in, as
+   * if it had been started that long ago.
+   * If pattern is 0, this doesn't do anything.
+   */
+#ifdef __LED_SEQUENCE_ENABLED__
+  void LedDef::startSequence(const unsigned char *pattern,
+                             unsigned short phase) {
+    if (pattern) {
+      holdOwner();
+      if (!isFading()) {
+        // The first RAMP starts from what the LED is showing.
+        level = ledIsOn?0xFF00:0;
+      }
+      sequence = pattern;
+      pc = 0;
+      seqRepeat = 0;
+      displayMode = SEQUENCE;
+      runSequence(currentTime(), phase);
+      reschedule();
+      commitOwner();
+    }
+  }
+
+  /**
+   * Run the pattern from pc up to the next instruction that takes time. skip
+   * is how far past the start of that instruction the pattern already is:
+   * whole HOLDs and RAMPs inside it are passed over, and the one it ends in
+   * is started as far along as it would be by now.
+   */
+  void LedDef::runSequence(unsigned long now, unsigned long skip) {
+    unsigned char steps = 0;
+    while (steps++ < SPARKLE_SEQ_MAX_STEPS) {
+      const unsigned char *at = sequence + pc;
+      switch (pgm_read_byte(at)) {
+        case SPARKLE_SEQ_SET:
+          level = (unsigned short)pgm_read_byte(at + 1) << 8;
+          showLevel();
+          pc += 2;
+          break;
+
+        case SPARKLE_SEQ_HOLD: {
+          unsigned short wait = sequenceWord(at + 1);
+          if (skip < wait) {
+            lastTime = now - skip;
+            return;
+          }
+          skip -= wait;
+          pc += 3;
+          if (wait > 0) {
+            steps = 0;
+          }
+          break;
+        }
+
+        case SPARKLE_SEQ_RAMP: {
+          unsigned char target = pgm_read_byte(at + 1);
+          unsigned short duration = sequenceWord(at + 2);
+          if (skip >= duration) {
+            level = (unsigned short)target << 8;
+            showLevel();
+            skip -= duration;
+            pc += 4;
+            if (duration > 0) {
+              steps = 0;
+            }
+            break;
+          }
+          // Work out the per-tick step once, so update() never divides.
+          unsigned char from = level >> 8;
+          fadingUp = (target > from);
+          unsigned short range =
+            (unsigned short)(fadingUp?(target - from):(from - target)) << 8;
+          seqStep = range / duration;
+          if (seqStep == 0) {
+            seqStep = 1;
+          }
+          lastTime = now;
+          bool done = stepRamp(skip);
+          showLevel();
+          if (!done) {
+            return;
+          }
+          pc += 4;
+          break;
+        }
+
+        case SPARKLE_SEQ_JUMP:
+          pc = pgm_read_byte(at + 1);
+          break;
+
+        case SPARKLE_SEQ_REPEAT:
+          if (seqRepeat == 0) {
+            seqRepeat = pgm_read_byte(at + 2);
+          } else {
+            seqRepeat--;
+          }
+          pc = (seqRepeat > 0)?pgm_read_byte(at + 1):pc + 3;
+          break;
+
+        default:
+          // END: settle on plain on or off. While still in SEQUENCE mode,
+          // write() also takes a faded pin off its PWM timer.
+          setLit(level >= 0x8000);
+          write();
+          displayMode = MANUAL;
+          return;
+      }
+    }
+  }
+
+  /**
+   * Move the level of the current RAMP by delta ticks. Returns true when it
+   * reached the target, with delta then the ticks left over past that.
+   */
+  bool LedDef::stepRamp(unsigned long &delta) {
+    unsigned long target = (unsigned long)pgm_read_byte(sequence + pc + 1) << 8;
+    unsigned long step = delta * seqStep;
+    if (fadingUp?(level + step >= target):(level <= target + step)) {
+      unsigned long left = fadingUp?(target - level):(level - target);
+      delta -= (left + seqStep - 1) / seqStep;
+      level = target;
+      return true;
+    }
+    level = fadingUp?(level + step):(level - step);
+    return false;
+  }
+
+  /**
+   * Output the sequence level: as a fade level, or on/off if the LED can't
+   * fade.
+   */
+  void LedDef::showLevel() {
+    if (canFade()) {
+      setLit(level >= 0x0100);
+      writeLevel();
+    } else if (level >= 0x8000) {
+      on();
+    } else {
+      off();
+    }
+  }
+#endif
+
+  /**
+   * Call periodically to update the state.
+   */
+  void LedDef::update() {
+    update(currentTime());
+  }
+
+  /**
+   * Update the state as of time now. Elapsed times are always taken as
+   * now - lastTime, which stays correct when the clock rolls over.
+   */
+  void LedDef::update(unsigned long now) {
+    holdOwner();
+    step(now);
+    commitOwner();
+  }
+
+  /**
+   * update(now) for an owner that already holds its output.
+   */
+  void LedDef::step(unsigned long now) {
+    (void)now;
+    switch (displayMode) {
+#ifdef __LED_BLINK_ENABLED__
+      case BLINK:
+        if (ledIsOn) {
+          // LED is currently on. See if on duration has expired.
+          if ((now - lastTime) >= blinkOnDuration) {
+            off();
+            lastTime = now;
+          }
+        } else {
+          // LED is currently off. See if off duration has expired.
+          if ((now - lastTime) >= blinkOffDuration) {
+            on();
+            lastTime = now;
+          }
+        }
+        break;
+#endif
+
+#ifdef __LED_BLINK_RANDOM_ENABLED__
+      case BLINK_RANDOM:
+        if (ledIsOn) {
+          // LED is currently on. See if on duration has expired.
+          if ((now - lastTime) >= randDuration) {
+            off();
+            lastTime = now;
+            randDuration = randomBetween(randMinOffDuration, randMaxOffDuration);
+          }
+        } else {
+          // LED is currently off. See if off duration has expired.
+          if ((now - lastTime) >= randDuration) {
+            on();
+            lastTime = now;
+            randDuration = randomBetween(randMinOnDuration, randMaxOnDuration);
           }
         }
         break;
 #endif
 
-#ifdef __LED_TIMED_ENABLED__
-      case TIMED:
-        if (ledIsOn) {
-          // LED is currently on. See if on duration has expired.
-          if (millis() >= (lastTime + timerDuration)) {
-            off();
-            displayMode = MANUAL;
-          }
-        }
-        break;
+#ifdef __LED_TIMED_ENABLED__
+      case TIMED:
+        if (ledIsOn) {
+          // LED is currently on. See if on duration has expired.
+          if ((now - lastTime) >= timerDuration) {
+            off();
+            displayMode = MANUAL;
+          }
+        }
+        break;
+#endif
+
+#ifdef __LED_FADE_ENABLED__
+      case FADE:
+        if ((now - lastTime) >= frameTicks()) {
+          // Step the 8.8 level by the elapsed time, bouncing between the
+          // limits.
+          unsigned long delta = now - lastTime;
+          lastTime = now;
+          if (fadingUp) {
+            unsigned long top = (unsigned long)fadeMax << 8;
+            unsigned long next = level + delta * fadeUpStep;
+            if (next >= top) {
+              next = top;
+              fadingUp = false;
+            }
+            level = next;
+          } else {
+            unsigned long bottom = (unsigned long)fadeMin << 8;
+            unsigned long step = delta * fadeDownStep;
+            if (level <= bottom + step) {
+              level = bottom;
+              fadingUp = true;
+            } else {
+              level -= step;
+            }
+          }
+          writeLevel();
+        }
+        break;
+#endif
+
+#ifdef __LED_SEQUENCE_ENABLED__
+      case SEQUENCE:
+        if (pgm_read_byte(sequence + pc) == SPARKLE_SEQ_HOLD) {
+          unsigned short wait = sequenceWord(sequence + pc + 1);
+          if ((now - lastTime) >= wait) {
+            // Go on from when the hold was due rather than from now, so LEDs
+            // sharing a pattern stay in phase.
+            lastTime += wait;
+            pc += 3;
+            runSequence(now, now - lastTime);
+          }
+        } else if ((now - lastTime) >= frameTicks()) {
+          // RAMP
+          unsigned long delta = now - lastTime;
+          lastTime = now;
+          bool done = stepRamp(delta);
+          showLevel();
+          if (done) {
+            // Go on from when the ramp ended, as after a HOLD.
+            pc += 4;
+            runSequence(now, delta);
+          }
+        }
+        break;
+#endif
+
+      case MANUAL:
+      default:
+        break;
+    }
+  }
+
+// RgbLedDef Class ///////////////////////////////////////////////////////////////
+
+  /**
+   * Show the color at the given brightness (0-255, after gamma).
+   */
+  void RgbLedDef::writeRgb(unsigned char duty) {
+#ifdef __USE_SPARKLE__
+    if (owner && owner->frame) {
+      owner->writePixel(*this, duty);
+      return;
+    }
+#endif
+    // (duty + 1) * c >> 8 is exact at both ends: 0 stays 0, 255 keeps c.
+    unsigned short scale = duty + 1;
+    writeChannel(pin,
+#ifdef SPARKLE_PORT_IO
+                 port, bit,
+#else
+                 SPARKLE_NO_PORT, 0,
+#endif
+                 (scale * red) >> 8);
+    writeChannel(greenPin,
+#ifdef SPARKLE_PORT_IO
+                 greenPort, greenBit,
+#else
+                 SPARKLE_NO_PORT, 0,
+#endif
+                 (scale * green) >> 8);
+    writeChannel(bluePin,
+#ifdef SPARKLE_PORT_IO
+                 bluePort, blueBit,
+#else
+                 SPARKLE_NO_PORT, 0,
+#endif
+                 (scale * blue) >> 8);
+  }
+
+  /**
+   * Output one channel: software PWM if a SparkleBam is attached,
+   * analogWrite() on PWM pins, or plain on/off otherwise.
+   */
+  void RgbLedDef::writeChannel(unsigned char channelPin,
+                               unsigned char channelPort,
+                               SparklePortMask channelBit,
+                               unsigned char value) {
+#ifdef SPARKLE_PORT_IO
+    if (channelPort != SPARKLE_NO_PORT) {
+      if (owner->bamPlanes) {
+        owner->writePortLevel(channelPort, channelBit, value);
+        return;
+      }
+      if (!pwm) {
+        owner->writePort(channelPort, channelBit, value >= 128);
+        return;
+      }
+    }
+#else
+    (void)channelPort;
+    (void)channelBit;
+#endif
+    if (pwm) {
+      // analogWrite() of 0 or 255 also takes the pin off its PWM timer.
+      analogWrite(channelPin, commonCathode?value:(255 - value));
+    } else {
+      digitalWrite(channelPin, ((value >= 128) == commonCathode)?HIGH:LOW);
+    }
+  }
+
+  /**
+   * Show the color again after it changed.
+   */
+  void RgbLedDef::refresh() {
+#ifdef __LED_FADE_ENABLED__
+    if (isFading()) {
+      writeLevel();
+      return;
+    }
+#endif
+    if (ledIsOn) {
+      write();
+    }
+  }
+
+  /**
+   * Set the color from red, green and blue values (0-255).
+   */
+  void RgbLedDef::setRgb(unsigned char r, unsigned char g, unsigned char b) {
+    red = r;
+    green = g;
+    blue = b;
+    refresh();
+  }
+
+  /**
+   * a * b / 255, rounded, without a division: exact for all 8-bit a and b,
+   * so full scale keeps the other value.
+   */
+  static unsigned char scale255(unsigned char a, unsigned char b) {
+    unsigned short x = a * b + 128;
+    return (x + (x >> 8)) >> 8;
+  }
+
+  /**
+   * Set the color from hue, saturation and value (0-255 each). The hue circle
+   * is split into six 43-step sectors with a multiply and shift; integer only.
+   */
+  void RgbLedDef::setHsv(unsigned char hue, unsigned char saturation,
+                         unsigned char value) {
+    unsigned short sextant = hue * 6;
+    unsigned char sector = sextant >> 8;
+    unsigned char rise = sextant & 0xFF;
+    unsigned char p = scale255(value, 255 - saturation);
+    unsigned char q = scale255(value, 255 - scale255(saturation, rise));
+    unsigned char t = scale255(value, 255 - scale255(saturation, 255 - rise));
+    switch (sector) {
+      case 0:  setRgb(value, t, p); break;
+      case 1:  setRgb(q, value, p); break;
+      case 2:  setRgb(p, value, t); break;
+      case 3:  setRgb(p, q, value); break;
+      case 4:  setRgb(t, p, value); break;
+      default: setRgb(value, p, q); break;
+    }
+  }
+
+// Sparkle Class /////////////////////////////////////////////////////////////////
+
+#ifdef __USE_SPARKLE__
+/**
+ * Claim the LEDs and index them by color.
+ */
+void Sparkle::init() {
+  clock = millis;
+  nextDue = 0;
+  scheduled = false;
+  cursor = 0;
+  frame = 0;
+  holds = 0;
+  timeSampled = false;
+  listener = 0;
+  listenerContext = 0;
+  eventsPending = false;
+  queued = 0;
+  brightness = 255;
+  frameInterval = 1;
+#ifdef __SPARKLE_STATS_ENABLED__
+  resetStats();
+#endif
+#ifdef __SPARKLE_GROUP_ENABLED__
+  groups = 0;
+#endif
+#ifdef SPARKLE_PORT_IO
+  portCount = 0;
+  bamPlanes = 0;
+  maxLit = 0;
+  shareStart = 0;
+  shareDue = 0;
+  overBudget = false;
+#endif
+  movable = false;
+  reindex();
+}
+
+/**
+ * Claim the LEDs and rebuild the per-color lists. Each color's list is
+ * threaded through the LEDs in array order.
+ */
+void Sparkle::reindex() {
+  for (unsigned char c=0; c<SPARKLE_COLORS; c++) {
+    firstOfColor[c] = SPARKLE_NO_LED;
+  }
+  for (unsigned short i=count; i-- > 0;) {
+    led(i).owner = this;
+    led(i).nextOfColor = firstOfColor[led(i).color];
+    firstOfColor[led(i).color] = i;
+  }
+}
+
+/**
+ * Fold an LED's next event into the cached earliest deadline. Deadlines are
+ * compared by signed difference so that clock rollover is harmless.
+ */
+void Sparkle::schedule(LedDef &led) {
+  unsigned long due;
+  if (led.nextEvent(due)) {
+    schedule(due);
+  }
+}
+
+void Sparkle::schedule(unsigned long due) {
+  if (!scheduled || ((long)(due - nextDue) < 0)) {
+    nextDue = due;
+    scheduled = true;
+  }
+}
+
+/**
+ * Claim LED i and add it to the front of its color's list.
+ */
+void Sparkle::linkColor(unsigned short i) {
+  LedDef &l = led(i);
+  l.owner = this;
+  l.nextOfColor = firstOfColor[l.color];
+  firstOfColor[l.color] = i;
+}
+
+/**
+ * Take LED i out of its color's list. Only that color's LEDs are visited.
+ */
+void Sparkle::unlinkColor(unsigned short i) {
+  unsigned short *link = &firstOfColor[led(i).color];
+  while ((*link != SPARKLE_NO_LED) && (*link != i)) {
+    link = &led(*link).nextOfColor;
+  }
+  if (*link == i) {
+    *link = led(i).nextOfColor;
+  }
+}
+
+#ifdef SPARKLE_PORT_IO
+/**
+ * Update the shadow state of one LED and mark it changed; write it through
+ * unless held.
+ */
+void Sparkle::writePort(unsigned char port, SparklePortMask bit, bool lit) {
+  LedPort &p = ports[port];
+  if (lit) {
+    p.state |= bit;
+  } else {
+    p.state &= ~bit;
+  }
+  if (bamPlanes) {
+    writePortLevel(port, bit, lit?brightness:0);
+  } else if (holds) {
+    p.changed |= bit;
+  } else if (maxLit) {
+    // Go through commit(), which keeps the budget.
+    p.changed |= bit;
+    hold();
+    commit();
+  } else {
+    flushPort(p, bit);
+  }
+}
+
+/**
+ * Set the software PWM duty of one LED in the BAM bit planes. Each plane is a
+ * single store, so the interrupt never sees a half-written port value.
+ */
+void Sparkle::writePortLevel(unsigned char port, SparklePortMask bit,
+                             unsigned char duty) {
+  SparklePortMask *planes = bamPlanes[port];
+  for (unsigned char b=0; b<8; b++) {
+    if (duty & (1 << b)) {
+      planes[b] |= bit;
+    } else {
+      planes[b] &= ~bit;
+    }
+  }
+}
+
+/**
+ * Write the masked bits of a port from its shadow state.
+ */
+void Sparkle::flushPort(LedPort &port, SparklePortMask bits) {
+  SparklePortMask value = ((port.state & port.shown) ^ port.invert) & bits;
+  SPARKLE_LOCK();
+  *port.out = (*port.out & ~bits) | value;
+  SPARKLE_UNLOCK();
+}
+#endif
+
+/**
+ * Set one LED's output bit in the attached frame, and show it unless held.
+ */
+void Sparkle::writeFrame(LedDef &led) {
+  unsigned short i = &led - leds;
+  unsigned char mask = 1 << (i & 7);
+  unsigned char &bits = frame->bits[i >> 3];
+  unsigned char value = (led.ledIsOn == led.commonCathode)?mask:0;
+  if ((bits & mask) != value) {
+    bits ^= mask;
+    frame->dirty = true;
+  }
+  if (!holds && frame->dirty) {
+    frame->dirty = false;
+    frame->show(*frame);
+  }
+}
+
+/**
+ * Set one LED's pixel in the attached pixel frame to its color at the given
+ * brightness, and show it unless held.
+ */
+void Sparkle::writePixel(LedDef &led, unsigned char duty) {
+  unsigned short i = led.rgb?
+                     ((unsigned char *)&led - (unsigned char *)leds) / stride:
+                     &led - leds;
+  unsigned char color[3];
+  if (led.rgb) {
+    RgbLedDef &c = static_cast<RgbLedDef &>(led);
+    color[0] = c.red;
+    color[1] = c.green;
+    color[2] = c.blue;
+  } else {
+    for (unsigned char c=0; c<3; c++) {
+      color[c] = pgm_read_byte(&sparkleColorRgb[led.color][c]);
+    }
+  }
+  unsigned char *pixel = frame->pixels + i * 3;
+  // (duty + 1) * c >> 8 is exact at both ends, as in RgbLedDef::writeRgb().
+  unsigned short scale = duty + 1;
+  for (unsigned char c=0; c<3; c++) {
+    unsigned char value = (scale * color[c]) >> 8;
+    unsigned char &out = pixel[frame->channels[c]];
+    if (out != value) {
+      out = value;
+      frame->dirty = true;
+    }
+  }
+  if (!holds && frame->dirty) {
+    frame->dirty = false;
+    frame->show(*frame);
+  }
+}
+
+/**
+ * Drive the LEDs through a framebuffer instead of MCU pins. Ignored if the
+ * frame is smaller than the list, the list is a SparklePool, or it holds
+ * RgbLedDefs and the frame has no pixels.
+ */
+void Sparkle::attach(SparkleFrame &output) {
+  if ((output.size >= count) &&
+      ((stride == sizeof(LedDef)) || output.pixels) && !movable) {
+    frame = &output;
+  }
+}
+
+/**
+ * Hold back LED output: changes only go to the shadow ports or frame until
+ * the matching commit(). Holds nest.
+ */
+void Sparkle::hold() {
+  holds++;
+}
+
+/**
+ * End a hold. When the last hold ends, write out what changed: only the
+ * changed bits of the ports that have any, in one write per port, and the
+ * frame only if a bit in it changed.
+ */
+void Sparkle::commit() {
+  if (holds > 0) {
+    holds--;
+  }
+  if (holds > 0) {
+    return;
+  }
+  if (frame && frame->dirty) {
+    frame->dirty = false;
+    frame->show(*frame);
+  }
+#ifdef SPARKLE_PORT_IO
+  if (!bamPlanes) {
+    bool all = maxLit && share();
+    for (unsigned char p=0; p<portCount; p++) {
+      SparklePortMask bits = all?ports[p].mask:ports[p].changed;
+      if (bits) {
+        flushPort(ports[p], bits);
+        ports[p].changed = 0;
+      }
+    }
+  }
+#endif
+  if (eventsPending) {
+    deliverEvents();
+  }
+}
+
+/**
+ * Remember that led has an event for the listener, or once the queue is full,
+ * that there are too many to remember.
+ */
+void Sparkle::queueEvent(LedDef &led) {
+  if (queued < SPARKLE_EVENT_QUEUE) {
+    eventQueue[queued] = &led;
+  }
+  if (queued <= SPARKLE_EVENT_QUEUE) {
+    queued++;
+  }
+  eventsPending = true;
+}
+
+/**
+ * Tell the listener about the LEDs that turned on or off during the hold
+ * that just ended, and are still that way: only the queued ones, unless the
+ * queue overflowed. The listener may change LEDs; what it changes is told in
+ * turn, once its own call is done.
+ */
+void Sparkle::deliverEvents() {
+  // Take this hold's queue, since the listener's own changes refill it.
+  LedDef *pending[SPARKLE_EVENT_QUEUE];
+  unsigned char n = queued;
+  bool all = (n > SPARKLE_EVENT_QUEUE);
+  for (unsigned char k=0; !all && (k<n); k++) {
+    pending[k] = eventQueue[k];
+  }
+  queued = 0;
+  eventsPending = false;
+  for (unsigned short k=0; k<(all?count:n); k++) {
+    LedDef &l = all?led(k):*pending[k];
+    if (l.eventPending) {
+      l.eventPending = false;
+      if ((l.ledIsOn != l.eventWasOn) && listener) {
+        listener(l, l.ledIsOn, listenerContext);
+      }
+    }
+  }
+}
+
+#ifdef SPARKLE_PORT_IO
+/**
+ * Choose which lit LEDs the ports show this frame. Over budget, the lit LEDs
+ * are counted off in port order and a window of maxLit of them is shown,
+ * moving on by maxLit once every frame interval; the end of the frame is
+ * then scheduled so the window keeps moving. Commits within a frame only
+ * follow the lit LEDs into the current window. Returns true if the shown
+ * masks may have changed.
+ */
+bool Sparkle::share() {
+  unsigned short lit = 0;
+  for (unsigned char p=0; p<portCount; p++) {
+    for (SparklePortMask b=ports[p].state & ports[p].mask; b; b &= b - 1) {
+      lit++;
+    }
+  }
+  if (lit <= maxLit) {
+    if (!overBudget) {
+      return false;
+    }
+    overBudget = false;
+    for (unsigned char p=0; p<portCount; p++) {
+      ports[p].shown = ~(SparklePortMask)0;
+    }
+    return true;
+  }
+
+  unsigned long now = clock();
+  if (!overBudget) {
+    overBudget = true;
+    shareDue = now + frameInterval;
+  } else if ((long)(now - shareDue) >= 0) {
+    shareStart += maxLit;
+    shareDue = now + frameInterval;
+  }
+  while (shareStart >= lit) {
+    shareStart -= lit;
+  }
+  // The window is [shareStart, shareStart + maxLit), wrapping past lit.
+  unsigned short end = shareStart + maxLit;
+  unsigned short k = 0;
+  for (unsigned char p=0; p<portCount; p++) {
+    SparklePortMask shown = 0;
+    for (SparklePortMask b=ports[p].state & ports[p].mask; b; b &= b - 1) {
+      if (((k >= shareStart) && (k < end)) || (k + lit < end)) {
+        shown |= b & ~(b - 1);
+      }
+      k++;
+    }
+    ports[p].shown = shown;
+  }
+  schedule(shareDue);
+  return true;
+}
+
+/**
+ * Let at most leds of the port-batched LEDs be lit at once (0 for no limit).
+ */
+void Sparkle::setMaxLit(unsigned short leds) {
+  maxLit = leds;
+  hold();
+  if (!maxLit && overBudget) {
+    overBudget = false;
+    for (unsigned char p=0; p<portCount; p++) {
+      ports[p].shown = ~(SparklePortMask)0;
+      ports[p].changed = ports[p].mask;
+    }
+  }
+  commit();
+}
+#endif
+
+/**
+ * Scale the brightness (0-255) of everything shown as a level, and show the
+ * LEDs again at the new brightness.
+ */
+void Sparkle::setBrightness(unsigned char level) {
+  brightness = level;
+  hold();
+  for (unsigned short i=0; i<count; i++) {
+    LedDef &l = led(i);
+#ifdef __LED_FADE_ENABLED__
+    if (l.isFading()) {
+      l.writeLevel();
+      continue;
+    }
+#endif
+    l.write();
+  }
+  commit();
+}
+
+/**
+ * Change fade and sequence levels at most once every ticks ticks.
+ */
+void Sparkle::setFrameInterval(unsigned short ticks) {
+  frameInterval = ticks?ticks:1;
+  // Fading and sequenced LEDs may now be due sooner.
+  for (unsigned short i=0; i<count; i++) {
+    schedule(led(i));
+  }
+}
+
+#ifdef SPARKLE_PORT_IO
+/**
+ * Add a pin to the port groups. Returns its port index, or SPARKLE_NO_PORT if
+ * the pin isn't on a port or all port groups are taken.
+ */
+unsigned char Sparkle::groupPin(unsigned char pin, bool commonCathode,
+                                SparklePortMask &bit) {
+  if (digitalPinToPort(pin) == NOT_A_PORT) {
+    return SPARKLE_NO_PORT;
+  }
+  volatile SparklePortMask *out = portOutputRegister(digitalPinToPort(pin));
+  unsigned char p = 0;
+  while ((p < portCount) && (ports[p].out != out)) {
+    p++;
+  }
+  if (p == portCount) {
+    if (portCount == SPARKLE_MAX_PORTS) {
+      return SPARKLE_NO_PORT;
+    }
+    ports[p].out = out;
+    ports[p].mode = portModeRegister(digitalPinToPort(pin));
+    ports[p].mask = 0;
+    ports[p].invert = 0;
+    ports[p].state = 0;
+    ports[p].changed = 0;
+    ports[p].shown = ~(SparklePortMask)0;
+    portCount++;
+  }
+  bit = digitalPinToBitMask(pin);
+  ports[p].mask |= bit;
+  ports[p].changed |= bit;
+  if (!commonCathode) {
+    ports[p].invert |= bit;
+  }
+  return p;
+}
+
+/**
+ * Add all pins of an LED to the port groups.
+ */
+void Sparkle::groupLed(LedDef &l) {
+  l.port = groupPin(l.pin, l.commonCathode, l.bit);
+  if (l.rgb) {
+    RgbLedDef &c = static_cast<RgbLedDef &>(l);
+    c.greenPort = groupPin(c.greenPin, c.commonCathode, c.greenBit);
+    c.bluePort = groupPin(c.bluePin, c.commonCathode, c.blueBit);
+  }
+}
+
+/**
+ * Take a pin out of its port group, so its bit is no longer written. It is
+ * written one last time with its shadow state first, which also wins over a
+ * half-shown BAM plane. The port itself stays, for the other LEDs on it.
+ */
+void Sparkle::ungroupPin(unsigned char port, SparklePortMask bit) {
+  if (port == SPARKLE_NO_PORT) {
+    return;
+  }
+  LedPort &p = ports[port];
+  flushPort(p, bit);
+  p.mask &= ~bit;
+  p.invert &= ~bit;
+  p.state &= ~bit;
+  p.changed &= ~bit;
+  p.shown |= bit;
+}
+
+/**
+ * Take all pins of an LED out of the port groups.
+ */
+void Sparkle::ungroupLed(LedDef &l) {
+  ungroupPin(l.port, l.bit);
+  l.port = SPARKLE_NO_PORT;
+  if (l.rgb) {
+    RgbLedDef &c = static_cast<RgbLedDef &>(l);
+    ungroupPin(c.greenPort, c.greenBit);
+    ungroupPin(c.bluePort, c.blueBit);
+    c.greenPort = SPARKLE_NO_PORT;
+    c.bluePort = SPARKLE_NO_PORT;
+  }
+}
 #endif
 
-#ifdef __LED_FADE_ENABLED__
-      case FADE:
-        if (pwm) {
-          //TODO
-        }
-        break;
+/**
+ * Used to set the list of LEDs to manage to digital output. This also groups
+ * the LEDs by port, so call it again if you change any LED's pin.
+ */
+void Sparkle::initPins() {
+  if (frame) {
+    hold();
+    for (unsigned short i=0; i<count; i++) {
+      led(i).reset();
+    }
+    // Push the whole frame even if no bit changed.
+    frame->dirty = true;
+    commit();
+    return;
+  }
+#ifdef SPARKLE_PORT_IO
+  portCount = 0;
+  for (unsigned short i=0; i<count; i++) {
+    groupLed(led(i));
+  }
 #endif
+  hold();
+  for (unsigned short i=0; i<count; i++) {
+    led(i).initPin();
+  }
+  commit();
+}
 
-      case MANUAL:
-      default:
-        break;
-    }
+/**
+ * Bytes of a saveState() blob for these LEDs: a header, the LEDs' records
+ * and a checksum.
+ */
+#define SPARKLE_STATE_HEADER 7
+
+unsigned short Sparkle::stateSize() {
+  unsigned short bytes = SPARKLE_STATE_HEADER + 1;
+  if (count) {
+    bytes += count * led(0).stateBytes();
   }
+  return bytes;
+}
 
-// Sparkle Class /////////////////////////////////////////////////////////////////
+/**
+ * Sum of the bytes before a blob's checksum.
+ */
+static unsigned char stateChecksum(const unsigned char *blob,
+                                   unsigned short size) {
+  unsigned char sum = 0;
+  for (unsigned short i=0; i<size - 1; i++) {
+    sum += blob[i];
+  }
+  return sum;
+}
 
-#ifdef __USE_SPARKLE__
 /**
- * Used to set the list of LEDs to manage to digital output.
+ * Save the mode and settings of every LED into blob. Returns the bytes used,
+ * or 0 if size is too small.
  */
-void Sparkle::initPins() {
+unsigned short Sparkle::saveState(unsigned char *blob, unsigned short size) {
+  unsigned short bytes = stateSize();
+  if (size < bytes) {
+    return 0;
+  }
+  blob[0] = 'S';
+  blob[1] = 'k';
+  blob[2] = SPARKLE_STATE_VERSION;
+  blob[3] = (unsigned char)(SPARKLE_FEATURES);
+  blob[4] = count;
+  blob[5] = count >> 8;
+  blob[6] = count?led(0).stateBytes():0;
+  unsigned char *at = blob + SPARKLE_STATE_HEADER;
+  for (unsigned short i=0; i<count; i++) {
+    led(i).saveState(at);
+  }
+  blob[bytes - 1] = stateChecksum(blob, bytes);
+  return bytes;
+}
+
+/**
+ * Bring the LEDs back as saveState() left them, instead of initPins().
+ * Returns false, changing nothing, if the blob doesn't fit these LEDs.
+ */
+bool Sparkle::loadState(const unsigned char *blob, unsigned short size) {
+  unsigned short bytes = stateSize();
+  if ((size < bytes) || (blob[0] != 'S') || (blob[1] != 'k') ||
+      (blob[2] != SPARKLE_STATE_VERSION) ||
+      (blob[3] != (unsigned char)(SPARKLE_FEATURES)) ||
+      (blob[4] != (unsigned char)count) || (blob[5] != (count >> 8)) ||
+      (blob[6] != (count?led(0).stateBytes():0)) ||
+      (blob[bytes - 1] != stateChecksum(blob, bytes))) {
+    return false;
+  }
+  const unsigned char *at = blob + SPARKLE_STATE_HEADER;
+  unsigned long now = clock();
+  for (unsigned short i=0; i<count; i++) {
+    led(i).loadState(at);
+    led(i).lastTime = now;
+  }
+#ifdef SPARKLE_PORT_IO
+  if (!frame) {
+    portCount = 0;
+    for (unsigned short i=0; i<count; i++) {
+      groupLed(led(i));
+    }
+  }
+#endif
+  // Batched pins only go to the shadow ports here, so commit() sets each
+  // port's levels in one write, before they become outputs.
+  hold();
+  for (unsigned short i=0; i<count; i++) {
+    led(i).restore();
+  }
+  if (frame) {
+    frame->dirty = true;
+  }
+  commit();
+#ifdef SPARKLE_PORT_IO
+  if (!frame) {
+    for (unsigned char p=0; p<portCount; p++) {
+      SPARKLE_LOCK();
+      *ports[p].mode |= ports[p].mask;
+      SPARKLE_UNLOCK();
+    }
+  }
+#endif
+  scheduled = false;
   for (unsigned short i=0; i<count; i++) {
-    leds[i].initPin();
+    schedule(led(i));
   }
+  return true;
 }
 
 /**
  * Turn off all managed LEDs.
  */
 void Sparkle::allOff() {
+  hold();
   for (unsigned short i=0; i<count; i++) {
-    leds[i].turnOff();
+    led(i).turnOff();
   }
+  commit();
 }
 
 /**
  * Turn on all managed LEDs.
  */
 void Sparkle::allOn() {
+  hold();
   for (unsigned short i=0; i<count; i++) {
-    leds[i].turnOn();
+    led(i).turnOn();
   }
+  commit();
 }
 
 /**
- * Turn on all LEDs of a particular color.
+ * Turn on all LEDs of a particular color. Only the LEDs of that color are
+ * visited.
  * color to turn on.
  */
 void Sparkle::turnOnAllColor(enum LedColor color) {
-  for (unsigned short i=0; i<count; i++) {
-    if (leds[i].getColor() == color) {
-      leds[i].turnOn();
-    }
+  hold();
+  for (unsigned short i=firstOfColor[color]; i!=SPARKLE_NO_LED;
+       i=led(i).nextOfColor) {
+    led(i).turnOn();
   }
+  commit();
 }
 
 /**
- * Turn off all LEDs of a particular color.
+ * Turn off all LEDs of a particular color. Only the LEDs of that color are
+ * visited.
  * color to turn off.
  */
 void Sparkle::turnOffAllColor(enum LedColor color) {
-  for (unsigned short i=0; i<count; i++) {
-    if (leds[i].getColor() == color) {
-      leds[i].turnOff();
-    }
+  hold();
+  for (unsigned short i=firstOfColor[color]; i!=SPARKLE_NO_LED;
+       i=led(i).nextOfColor) {
+    led(i).turnOff();
+  }
+  commit();
+}
+
+/**
+ * Do op to every selected LED, with one time sample and one commit.
+ */
+void Sparkle::select(const SparkleSelector &leds, unsigned char op,
+                     unsigned short a, unsigned short b,
+                     unsigned char low, unsigned char high) {
+  bool sampled = timeSampled;
+  if (!sampled) {
+    sampledTime = clock();
+    timeSampled = true;
+  }
+  LedDef *model = 0;
+  hold();
+  switch (leds.kind) {
+    case SparkleSelector::RANGE:
+      for (unsigned short i=leds.first;
+           (i < count) && (i - leds.first < leds.size); i++) {
+        selectOne(led(i), op, model, a, b, low, high);
+      }
+      break;
+
+    case SparkleSelector::COLORS:
+      for (unsigned char color=0; color<SPARKLE_COLORS; color++) {
+        if (leds.colorMask & SPARKLE_COLOR(color)) {
+          for (unsigned short i=firstOfColor[color]; i!=SPARKLE_NO_LED;
+               i=led(i).nextOfColor) {
+            selectOne(led(i), op, model, a, b, low, high);
+          }
+        }
+      }
+      break;
+
+    case SparkleSelector::BITS:
+      for (unsigned short i=0; (i < count) && (i < leds.size); i++) {
+        unsigned char byte = leds.bits[i >> 3];
+        if (byte == 0) {
+          // Skip the rest of an empty byte.
+          i |= 7;
+        } else if (byte & (1 << (i & 7))) {
+          selectOne(led(i), op, model, a, b, low, high);
+        }
+      }
+      break;
+  }
+  commit();
+  timeSampled = sampled;
+}
+
+/**
+ * Do op to one LED. model is the first LED set up by a SELECT_SET_FADE,
+ * whose fade steps the rest copy, or 0.
+ */
+void Sparkle::selectOne(LedDef &l, unsigned char op, LedDef *&model,
+                        unsigned short a, unsigned short b,
+                        unsigned char low, unsigned char high) {
+  (void)model;
+  (void)a;
+  (void)b;
+  (void)low;
+  (void)high;
+  switch (op) {
+    case SELECT_ON:
+      l.turnOn();
+      break;
+
+    case SELECT_OFF:
+      l.turnOff();
+      break;
+
+#ifdef __LED_BLINK_ENABLED__
+    case SELECT_SET_BLINK:
+      l.setBlink(a, b);
+      break;
+
+    case SELECT_START_BLINK:
+      l.startBlink();
+      break;
+#endif
+
+#ifdef __LED_TIMED_ENABLED__
+    case SELECT_SET_TIMER:
+      l.setTimer(a);
+      break;
+
+    case SELECT_START_TIMER:
+      l.startTimer();
+      break;
+#endif
+
+#ifdef __LED_FADE_ENABLED__
+    case SELECT_SET_FADE:
+      // Divide once, for the first LED, and copy its steps to the rest.
+      if (model) {
+        l.fadeMin = model->fadeMin;
+        l.fadeMax = model->fadeMax;
+        l.fadeUpStep = model->fadeUpStep;
+        l.fadeDownStep = model->fadeDownStep;
+      } else {
+        l.setFade(low, high, a, b);
+        model = &l;
+      }
+      break;
+
+    case SELECT_START_FADE:
+      l.startFade();
+      break;
+#endif
+
+    default:
+      break;
+  }
+}
+
+/**
+ * Turn on or off the selected LEDs.
+ */
+void Sparkle::turnOn(const SparkleSelector &leds) {
+  select(leds, SELECT_ON);
+}
+
+void Sparkle::turnOff(const SparkleSelector &leds) {
+  select(leds, SELECT_OFF);
+}
+
+/**
+ * The LedDef calls of the same names, for all selected LEDs at once.
+ */
+#ifdef __LED_BLINK_ENABLED__
+void Sparkle::setBlink(const SparkleSelector &leds, unsigned short onDuration,
+                       unsigned short offDuration) {
+  select(leds, SELECT_SET_BLINK, onDuration, offDuration);
+}
+
+void Sparkle::startBlink(const SparkleSelector &leds) {
+  select(leds, SELECT_START_BLINK);
+}
+#endif
+
+#ifdef __LED_TIMED_ENABLED__
+void Sparkle::setTimer(const SparkleSelector &leds, unsigned short duration) {
+  select(leds, SELECT_SET_TIMER, duration);
+}
+
+void Sparkle::startTimer(const SparkleSelector &leds) {
+  select(leds, SELECT_START_TIMER);
+}
+#endif
+
+#ifdef __LED_FADE_ENABLED__
+void Sparkle::setFade(const SparkleSelector &leds, unsigned char minLevel,
+                      unsigned char maxLevel, unsigned short upDuration,
+                      unsigned short downDuration) {
+  // As LedDef::setFade() would ignore them, and the copies must match.
+  if ((upDuration > 0) && (downDuration > 0) && (minLevel < maxLevel)) {
+    select(leds, SELECT_SET_FADE, upDuration, downDuration, minLevel,
+           maxLevel);
   }
 }
 
+void Sparkle::startFade(const SparkleSelector &leds) {
+  select(leds, SELECT_START_FADE);
+}
+#endif
+
 /**
  * Set the random blink mode with the max/min durations for both on and off.
  * This does not start the LEDs blinking randomly. To do that, call
@@ -311,7 +2016,7 @@ void Sparkle::setRandomly(unsigned short minOffDuration,
   if ((minOffDuration > 0) && (maxOffDuration > 0) &&
       (minOnDuration > 0) && (maxOnDuration > 0)) {
     for (unsigned short i=0; i<count; i++) {
-      leds[i].setRandomBlink(minOffDuration, maxOffDuration,
+      led(i).setRandomBlink(minOffDuration, maxOffDuration,
                              minOnDuration, maxOnDuration);
     }
   }
@@ -324,18 +2029,373 @@ void Sparkle::setRandomly(unsigned short minOffDuration,
  */
 #ifdef __LED_BLINK_RANDOM_ENABLED__
 void Sparkle::turnOnRandomly() {
+  hold();
+  for (unsigned short i=0; i<count; i++) {
+    led(i).startRandomBlink();
+  }
+  commit();
+}
+#endif
+
+/**
+ * Call listener whenever a managed LED turns on or off; 0 stops the calls.
+ */
+void Sparkle::setListener(SparkleListener callback, void *context) {
+  listener = callback;
+  listenerContext = context;
+}
+
+/**
+ * Set the clock that all timing of the managed LEDs is measured in.
+ */
+void Sparkle::setTimebase(SparkleClock timebase) {
+  clock = timebase;
+  scheduled = false;
   for (unsigned short i=0; i<count; i++) {
-    leds[i].startRandomBlink();
+    led(i).lastTime = clock();
+    schedule(led(i));
   }
+#ifdef __SPARKLE_GROUP_ENABLED__
+  for (SparkleGroup *g=groups; g; g=g->next) {
+    g->lastTime = clock();
+    if (g->running) {
+      schedule(g->lastTime + g->wait);
+    }
+  }
+#endif
+}
+
+/**
+ * Seed the generator behind all random blink durations of the managed LEDs.
+ */
+#ifdef __LED_BLINK_RANDOM_ENABLED__
+void Sparkle::seed(unsigned short value) {
+  rng.seed(value);
 }
 #endif
 
 /**
- * Update the status of the LEDs under Sparkle control.
+ * Update the status of the LEDs under Sparkle control. This is a single
+ * time check until the earliest LED deadline comes due; then only the LEDs
+ * that are due get updated, and the earliest deadline is recomputed.
  */
 void Sparkle::update() {
+  update(clock());
+}
+
+/**
+ * Update the status of the LEDs as of time now, on this Sparkle's timebase.
+ * Every LED sees the same time, so LEDs due together change together.
+ */
+void Sparkle::update(unsigned long now) {
+  if (!scheduled || ((long)(now - nextDue) < 0)) {
+#ifdef __LED_BLINK_RANDOM_ENABLED__
+    rng.refill(SPARKLE_RANDOM_SLICE);
+#endif
+    return;
+  }
+
+#ifdef __SPARKLE_STATS_ENABLED__
+  unsigned long start = micros();
+  stats.updates++;
+#endif
+  scheduled = false;
+  hold();
+#ifdef __SPARKLE_GROUP_ENABLED__
+  updateGroups(now);
+#endif
+  for (unsigned short i=0; i<count; i++) {
+    LedDef &l = led(i);
+    unsigned long due;
+    if (!l.nextEvent(due)) {
+      continue;
+    }
+    if ((long)(now - due) < 0) {
+      schedule(due);
+      continue;
+    }
+#ifdef __SPARKLE_STATS_ENABLED__
+    countLateness(i, now);
+#endif
+    l.step(now);
+    schedule(l);
+  }
+  commit();
+#ifdef __SPARKLE_STATS_ENABLED__
+  unsigned long took = micros() - start;
+  if (took > stats.maxUpdateMicros) {
+    stats.maxUpdateMicros = took;
+  }
+#endif
+}
+
+/**
+ * Update at most maxLeds of the LEDs that are due, most overdue first, and
+ * leave the rest for the next call. One pass over the deadlines picks the
+ * slice; everything not picked keeps its place in the cached minimum.
+ */
+void Sparkle::updateBudget(unsigned char maxLeds) {
+  unsigned long now = clock();
+  if (!scheduled || ((long)(now - nextDue) < 0) || (maxLeds == 0)) {
+#ifdef __LED_BLINK_RANDOM_ENABLED__
+    rng.refill(SPARKLE_RANDOM_SLICE);
+#endif
+    return;
+  }
+  if (maxLeds > SPARKLE_MAX_SLICE) {
+    maxLeds = SPARKLE_MAX_SLICE;
+  }
+
+  // picked[] is kept sorted, most overdue first.
+  unsigned short picked[SPARKLE_MAX_SLICE];
+  unsigned long late[SPARKLE_MAX_SLICE];
+  unsigned char n = 0;
+  scheduled = false;
+  unsigned short i = cursor;
+  for (unsigned short k=0; k<count; k++, i=((i + 1 == count)?0:i + 1)) {
+    unsigned long due;
+    if (!led(i).nextEvent(due)) {
+      continue;
+    }
+    unsigned long lateness = now - due;
+    if (((long)lateness < 0) || ((n == maxLeds) && (lateness <= late[n - 1]))) {
+      schedule(due);
+      continue;
+    }
+    if (n == maxLeds) {
+      // Bump the least overdue pick back into the schedule.
+      n--;
+      schedule(now - late[n]);
+    }
+    unsigned char j = n++;
+    while ((j > 0) && (late[j - 1] < lateness)) {
+      picked[j] = picked[j - 1];
+      late[j] = late[j - 1];
+      j--;
+    }
+    picked[j] = i;
+    late[j] = lateness;
+  }
+
+#ifdef __SPARKLE_STATS_ENABLED__
+  unsigned long start = micros();
+  stats.updates++;
+#endif
+  hold();
+#ifdef __SPARKLE_GROUP_ENABLED__
+  // A group costs one pass over its members, so it isn't rationed.
+  updateGroups(now);
+#endif
+  for (unsigned char j=0; j<n; j++) {
+#ifdef __SPARKLE_STATS_ENABLED__
+    countLateness(picked[j], now);
+#endif
+    led(picked[j]).step(now);
+    schedule(led(picked[j]));
+  }
+  commit();
+  if (n > 0) {
+    cursor = (picked[0] + 1 == count)?0:picked[0] + 1;
+  }
+#ifdef __SPARKLE_STATS_ENABLED__
+  unsigned long took = micros() - start;
+  if (took > stats.maxUpdateMicros) {
+    stats.maxUpdateMicros = took;
+  }
+#endif
+}
+
+/**
+ * Ticks until the next scheduled LED change: 0 if one is due now, or
+ * SPARKLE_NO_EVENT if nothing is scheduled.
+ */
+unsigned long Sparkle::nextEventIn() {
+  if (!scheduled) {
+    return SPARKLE_NO_EVENT;
+  }
+  long wait = nextDue - clock();
+  return (wait > 0)?wait:0;
+}
+
+/**
+ * Do background work in spare time: fill the random lookahead.
+ */
+void Sparkle::idle() {
+#ifdef __LED_BLINK_RANDOM_ENABLED__
+  rng.refill(SPARKLE_RANDOM_AHEAD);
+#endif
+}
+
+#ifdef __SPARKLE_STATS_ENABLED__
+/**
+ * Note how late LED i is, if it is due at now.
+ */
+void Sparkle::countLateness(unsigned short i, unsigned long now) {
+  LedDef &l = led(i);
+  unsigned long due;
+  if (!l.nextEvent(due) || ((long)(now - due) < 0)) {
+    return;
+  }
+  unsigned long late = now - due;
+  if (late > l.maxLateness) {
+    l.maxLateness = (late > 0xFFFF)?0xFFFF:late;
+  }
+  if (late > stats.maxLateness) {
+    stats.maxLateness = late;
+    stats.latestLed = i;
+  }
+}
+
+/**
+ * Clear the hot path counters, and every LED's maximum lateness.
+ */
+void Sparkle::resetStats() {
+  memset(&stats, 0, sizeof(stats));
   for (unsigned short i=0; i<count; i++) {
-    leds[i].update();
+    led(i).maxLateness = 0;
+  }
+}
+#endif
+
+#ifdef __SPARKLE_GROUP_ENABLED__
+/**
+ * Update the groups that are due and schedule their next changes.
+ */
+void Sparkle::updateGroups(unsigned long now) {
+  for (SparkleGroup *g=groups; g; g=g->next) {
+    g->update(now);
+    if (g->running) {
+      schedule(g->lastTime + g->wait);
+    }
+  }
+}
+
+// SparkleGroup Class ////////////////////////////////////////////////////////////
+
+/**
+ * Constructor. The group is the memberCount LEDs of sparkle's list from index
+ * firstLed on, cut short at the end of the list.
+ */
+SparkleGroup::SparkleGroup(Sparkle &owner, unsigned short firstLed,
+                           unsigned short memberCount):
+                           sparkle(owner),
+                           next(owner.groups),
+                           first(firstLed),
+                           size(0),
+                           onDuration(0),
+                           period(0),
+                           spacing(0),
+                           phase(0),
+                           wait(0),
+                           lastTime(0),
+                           running(false) {
+  if (firstLed < owner.count) {
+    size = owner.count - firstLed;
+    if (memberCount < size) {
+      size = memberCount;
+    }
+  }
+  owner.groups = this;
+}
+
+/**
+ * Set the blink durations on and off, shared by all members.
+ * If onDuration or offDuration are zero, or they add up to more than 65535,
+ * both settings are ignored.
+ */
+void SparkleGroup::setBlink(unsigned short onDuration,
+                            unsigned short offDuration) {
+  if ((onDuration > 0) && (offDuration > 0) &&
+      (offDuration <= 0xFFFF - onDuration)) {
+    this->onDuration = onDuration;
+    period = onDuration + offDuration;
+  }
+}
+
+/**
+ * Put the members in GROUPED mode and start blinking, each member
+ * memberSpacing ticks behind the one before it.
+ */
+void SparkleGroup::startBlink(unsigned short memberSpacing) {
+  if (period == 0) {
+    return;
+  }
+  spacing = memberSpacing % period;
+  sparkle.hold();
+  for (unsigned short i=first; i<first + size; i++) {
+    // turnOff() first, so that a fading member leaves its PWM timer.
+    sparkle.led(i).turnOff();
+    sparkle.led(i).displayMode = GROUPED;
+  }
+  phase = 0;
+  lastTime = sparkle.now();
+  running = true;
+  show();
+  sparkle.commit();
+  sparkle.schedule(lastTime + wait);
+}
+
+/**
+ * Stop the group and turn off the members still in it.
+ */
+void SparkleGroup::stop() {
+  running = false;
+  sparkle.hold();
+  for (unsigned short i=first; i<first + size; i++) {
+    if (sparkle.led(i).displayMode == GROUPED) {
+      sparkle.led(i).turnOff();
+    }
   }
+  sparkle.commit();
 }
+
+/**
+ * Show every member's state for the current phase, and work out when the
+ * next one changes. Each member's phase is the previous one's less the
+ * spacing, so there is no division per member.
+ */
+void SparkleGroup::show() {
+  unsigned short p = phase;
+  unsigned short soonest = period;
+  sparkle.hold();
+  for (unsigned short i=first; i<first + size; i++) {
+    LedDef &l = sparkle.led(i);
+    if (l.displayMode == GROUPED) {
+      unsigned short left;
+      if (p < onDuration) {
+        l.on();
+        left = onDuration - p;
+      } else {
+        l.off();
+        left = period - p;
+      }
+      if (left < soonest) {
+        soonest = left;
+      }
+    }
+    p = (p >= spacing)?(p - spacing):(p + (period - spacing));
+  }
+  sparkle.commit();
+  wait = soonest;
+}
+
+/**
+ * Advance the phase as of time now, if a member is due to change. The phase
+ * moves by the time that really passed, so a late update never loses ticks.
+ */
+void SparkleGroup::update(unsigned long now) {
+  unsigned long delta = now - lastTime;
+  if (!running || (delta < wait)) {
+    return;
+  }
+  lastTime = now;
+  if (delta >= period) {
+    // Only when more than a whole period late.
+    delta %= period;
+  }
+  unsigned long next = phase + delta;
+  phase = (next >= period)?(next - period):next;
+  show();
+}
+#endif
 #endif //__USE_SPARKLE__
@@ -6,21 +6,71 @@
  * these LED definitions to control the LEDs assigned to it.
  */
 
+#ifndef _SPARKLE_H_
+#define _SPARKLE_H_
+
 /**
- * You can save memory on your Arduino by defining only the Sparkle/LED features
- * that your code/project is using. Comment out a definition below to disable.
- * If you only want to control LEDs individually (without the Sparkle class), you
- * can comment out the __USE_SPARKLE__ line.
+ * You can save memory on your Arduino by building in only the Sparkle/LED
+ * features that your code/project is using: a disabled mode leaves out its
+ * LedDef fields, its update() code and (for BLINK_RANDOM) the random number
+ * generator. If you only want to control LEDs individually (without the
+ * Sparkle class), leave out SPARKLE_FEATURE_SPARKLE.
+ *
+ * Set SPARKLE_FEATURES to the features you want for the whole build, not in
+ * the sketch (the library is compiled on its own), e.g. with PlatformIO:
+ *
+ *   build_flags = -DSPARKLE_FEATURES=SPARKLE_FEATURE_BLINK|SPARKLE_FEATURE_SPARKLE
+ *
+ * or arduino-cli's --build-property compiler.cpp.extra_flags=... A sketch
+ * built with a different set than the library fails to link.
+ *
+ * The set is a build-wide mask rather than a template parameter of Sparkle
+ * because Sparkle.cpp is compiled once, apart from the sketch; a template
+ * would put the whole library in this header.
  */
-#define __LED_TIMED_ENABLED__ 1
-#define __LED_BLINK_ENABLED__ 1
-#define __LED_BLINK_RANDOM_ENABLED__ 1
-#define __LED_TIMED_ENABLED__ 1
-#define __LED_FADE_ENABLED__ 1
-#define __USE_SPARKLE__ 1
+#define SPARKLE_FEATURE_TIMED        0x01
+#define SPARKLE_FEATURE_BLINK        0x02
+#define SPARKLE_FEATURE_BLINK_RANDOM 0x04
+#define SPARKLE_FEATURE_FADE         0x08
+#define SPARKLE_FEATURE_SEQUENCE     0x10  // needs SPARKLE_FEATURE_FADE
+#define SPARKLE_FEATURE_SPARKLE      0x20
+#define SPARKLE_FEATURE_GROUP        0x40  // needs SPARKLE_FEATURE_SPARKLE
+#define SPARKLE_FEATURE_STATS        0x80  // needs SPARKLE_FEATURE_SPARKLE
 
-#ifndef _SPARKLE_H_
-#define _SPARKLE_H_
+/**
+ * FADE and SEQUENCE are left out unless asked for: their levels and pattern
+ * state take an LedDef from 29 to 43 bytes on AVR.
+ */
+#ifndef SPARKLE_FEATURES
+ #define SPARKLE_FEATURES (SPARKLE_FEATURE_TIMED | SPARKLE_FEATURE_BLINK | \
+                           SPARKLE_FEATURE_BLINK_RANDOM | SPARKLE_FEATURE_SPARKLE | \
+                           SPARKLE_FEATURE_GROUP)
+#endif
+
+#if (SPARKLE_FEATURES) & SPARKLE_FEATURE_TIMED
+ #define __LED_TIMED_ENABLED__ 1
+#endif
+#if (SPARKLE_FEATURES) & SPARKLE_FEATURE_BLINK
+ #define __LED_BLINK_ENABLED__ 1
+#endif
+#if (SPARKLE_FEATURES) & SPARKLE_FEATURE_BLINK_RANDOM
+ #define __LED_BLINK_RANDOM_ENABLED__ 1
+#endif
+#if (SPARKLE_FEATURES) & SPARKLE_FEATURE_FADE
+ #define __LED_FADE_ENABLED__ 1
+#endif
+#if (SPARKLE_FEATURES) & SPARKLE_FEATURE_SEQUENCE
+ #define __LED_SEQUENCE_ENABLED__ 1
+#endif
+#if (SPARKLE_FEATURES) & SPARKLE_FEATURE_SPARKLE
+ #define __USE_SPARKLE__ 1
+#endif
+#if ((SPARKLE_FEATURES) & SPARKLE_FEATURE_GROUP) && defined(__USE_SPARKLE__)
+ #define __SPARKLE_GROUP_ENABLED__ 1
+#endif
+#if ((SPARKLE_FEATURES) & SPARKLE_FEATURE_STATS) && defined(__USE_SPARKLE__)
+ #define __SPARKLE_STATS_ENABLED__ 1
+#endif
 
 #if (ARDUINO >= 100)
  #include "Arduino.h"
@@ -28,6 +78,21 @@
  #include "WProgram.h"
 #endif
 
+#if defined(__LED_SEQUENCE_ENABLED__) && !defined(__LED_FADE_ENABLED__)
+ #error "SPARKLE_FEATURE_SEQUENCE needs SPARKLE_FEATURE_FADE"
+#endif
+
+/**
+ * Defined by the library for the feature set it was built with. Sparkle's
+ * constructor refers to it for the sketch's set, so a mismatch, which would
+ * give the sketch and the library different LedDef layouts, can't link.
+ */
+template <unsigned int features>
+struct SparkleFeatureSet {
+};
+
+void sparkleFeatureCheck(SparkleFeatureSet<SPARKLE_FEATURES>);
+
 /**
  * Color definitions for LEDs.
  */
@@ -45,6 +110,149 @@ enum LedColor {
   WHITE
 };
 
+/**
+ * A port register value/bit mask. AVR ports are 8 bits wide, SAMD ports are 32.
+ * (SPARKLE_HOST_PORTS is the host build's fake AVR-like ports, see
+ * extras/host.)
+ */
+#if defined(__AVR__) || defined(SPARKLE_HOST_PORTS)
+typedef uint8_t SparklePortMask;
+#else
+typedef uint32_t SparklePortMask;
+#endif
+
+/**
+ * Port index of an LED that isn't batched.
+ */
+#define SPARKLE_NO_PORT 0xFF
+
+#ifdef __USE_SPARKLE__
+/**
+ * Direct port register output. On cores where the pin-to-port mapping is known
+ * (AVR and SAMD), Sparkle groups its LEDs by port and writes each port register
+ * once per pass instead of calling digitalWrite() for every LED. Other cores
+ * fall back to digitalWrite().
+ */
+#if defined(__AVR__) || defined(ARDUINO_ARCH_SAMD) || defined(SPARKLE_HOST_PORTS)
+ #define SPARKLE_PORT_IO 1
+#endif
+
+#ifdef SPARKLE_PORT_IO
+/**
+ * Port writes are read-modify-write, so keep interrupts (which may touch other
+ * pins on the same port) out while we do them. Also for the backends, whose
+ * refresh interrupts read what the main code writes.
+ */
+#if defined(__AVR__)
+ #define SPARKLE_LOCK()   uint8_t sparkleSreg = SREG; cli()
+ #define SPARKLE_UNLOCK() SREG = sparkleSreg
+#elif defined(ARDUINO_ARCH_SAMD)
+ #define SPARKLE_LOCK()   uint32_t sparklePrimask = __get_PRIMASK(); __disable_irq()
+ #define SPARKLE_UNLOCK() __set_PRIMASK(sparklePrimask)
+#else
+ // The host build has no interrupts.
+ #define SPARKLE_LOCK()   do {} while (0)
+ #define SPARKLE_UNLOCK() do {} while (0)
+#endif
+
+/**
+ * Number of distinct ports a Sparkle can batch. LEDs on any further ports are
+ * still driven, but with digitalWrite().
+ */
+#ifndef SPARKLE_MAX_PORTS
+ #if defined(__AVR_ATmega1280__) || defined(__AVR_ATmega2560__)
+  #define SPARKLE_MAX_PORTS 11
+ #elif defined(ARDUINO_ARCH_SAMD)
+  #define SPARKLE_MAX_PORTS 2
+ #else
+  #define SPARKLE_MAX_PORTS 4
+ #endif
+#endif
+
+class SparkleBam;
+#endif //SPARKLE_PORT_IO
+
+/**
+ * A timebase for Sparkle: returns the current time in ticks. All durations of
+ * the LEDs are counted in these ticks. millis() is the default; micros()
+ * allows sub-millisecond rates, or pass a function returning your own tick
+ * counter.
+ */
+typedef unsigned long (*SparkleClock)();
+
+/**
+ * Number of LedColor values, and the end-of-list marker of Sparkle's per-color
+ * LED lists.
+ */
+#define SPARKLE_COLORS (WHITE + 1)
+#define SPARKLE_NO_LED 0xFFFF
+
+/**
+ * Layout version of Sparkle::saveState() blobs. Blobs of another version, or
+ * saved with other SPARKLE_FEATURES or LEDs, don't load.
+ */
+#define SPARKLE_STATE_VERSION 1
+
+/**
+ * Most LEDs one Sparkle::updateBudget() call will update.
+ */
+#ifndef SPARKLE_MAX_SLICE
+ #define SPARKLE_MAX_SLICE 8
+#endif
+
+/**
+ * Returned by Sparkle::nextEventIn() when no LED has anything scheduled.
+ */
+#define SPARKLE_NO_EVENT 0xFFFFFFFFUL
+
+/**
+ * An output framebuffer with one bit per LED, in the order of Sparkle's LED
+ * list, for backends that don't drive LEDs from MCU pins (e.g. shift register
+ * chains, see SparkleShift.h). Sparkle sets the bits and calls show() to push
+ * them out, once per pass and only when a bit changed. A set bit is a HIGH
+ * output, so common anode LEDs are lit by a clear bit.
+ * Pixel backends (e.g. addressable strips, see SparkleStrip.h) set pixels
+ * instead of bits: 3 bytes per LED, with red, green and blue at the offsets
+ * in channels, in the order the strip takes them. Each LED then shows its
+ * color (an RgbLedDef's own, or its LedColor's) at its current brightness,
+ * and every LED can fade.
+ */
+struct SparkleFrame {
+  unsigned char *bits;
+  unsigned short size;          // in LEDs
+  bool dirty;
+  void (*show)(SparkleFrame &frame);
+  unsigned char *pixels;        // of a pixel backend, or 0
+  unsigned char channels[3];    // offsets of red, green and blue in a pixel
+};
+
+class Sparkle;
+#ifdef __SPARKLE_GROUP_ENABLED__
+class SparkleGroup;
+#endif
+
+class LedDef;
+
+/**
+ * Called by a Sparkle whenever one of its LEDs turns on or off, e.g. when a
+ * timer runs out or a blink edge comes, with the context given to
+ * Sparkle::setListener(). See there; with SparkleIsr, it is called from the
+ * timer interrupt.
+ */
+typedef void (*SparkleListener)(LedDef &led, bool on, void *context);
+
+/**
+ * LEDs with an event for the listener that a Sparkle keeps track of per
+ * hold (at least 1). With more, it looks through all its LEDs for them
+ * instead.
+ */
+#ifndef SPARKLE_EVENT_QUEUE
+ #define SPARKLE_EVENT_QUEUE 8
+#endif
+#endif //__USE_SPARKLE__
+
+class RgbLedDef;
+
 /**
  * Display modes for LEDs.
  */
@@ -61,61 +269,259 @@ enum DisplayMode {
 #endif
 #ifdef __LED_FADE_ENABLED__
   FADE,       // For PWM pins only
+#endif
+#ifdef __LED_SEQUENCE_ENABLED__
+  SEQUENCE,
+#endif
+#if defined(__USE_SPARKLE__) && defined(__SPARKLE_GROUP_ENABLED__)
+  GROUPED,    // Driven by a SparkleGroup
 #endif
   MANUAL
 };
 
+/**
+ * Counters of a Sparkle's hot path, for checking in the field that update()
+ * keeps up (see Sparkle::getStats()). Times are in the Sparkle's ticks,
+ * except maxUpdateMicros.
+ */
+#if defined(__USE_SPARKLE__) && defined(__SPARKLE_STATS_ENABLED__)
+struct SparkleStats {
+  unsigned long updates;        // update passes that ran
+  unsigned long transitions[MANUAL + 1];  // on/off changes, by the mode the LED was in
+  unsigned long writes;         // LED outputs written
+  unsigned long suppressed;     // writes skipped, the output already matched
+  unsigned long maxUpdateMicros;  // longest update pass
+  unsigned long maxLateness;    // most ticks an LED change came after its due time
+  unsigned short latestLed;     // index of the LED that was maxLateness late
+};
+#endif
+
+#ifdef __LED_SEQUENCE_ENABLED__
+/**
+ * Instructions of a SEQUENCE pattern (see LedDef::startSequence()). A pattern
+ * is a PROGMEM byte array of up to 256 bytes written with these macros, and
+ * positions are byte offsets into it. Levels are brightness 0-255, as for
+ * fades; on pins that can't fade, 128 and up is on.
+ *
+ *   SPARKLE_SET(level)          2 bytes: show level at once
+ *   SPARKLE_HOLD(ticks)         3 bytes: wait
+ *   SPARKLE_RAMP(level, ticks)  4 bytes: fade to level over ticks
+ *   SPARKLE_JUMP(pos)           2 bytes: carry on at pos
+ *   SPARKLE_REPEAT(pos, times)  3 bytes: go back to pos, times times over
+ *   SPARKLE_END                 1 byte:  stop in MANUAL mode, on if the
+ *                                        level is 128 or more, else off
+ *
+ * A heartbeat, two quick pulses and a pause:
+ *
+ *   const unsigned char heartbeat[] PROGMEM = {
+ *     SPARKLE_RAMP(255, 80), SPARKLE_RAMP(0, 120),  // 0, 4
+ *     SPARKLE_REPEAT(0, 1),                         // 8
+ *     SPARKLE_HOLD(600), SPARKLE_JUMP(0)            // 11, 14
+ *   };
+ *
+ * Every loop must contain a HOLD or RAMP. REPEATs don't nest: an LED has one
+ * repeat count, so a REPEAT must not be inside the loop of another.
+ */
+#define SPARKLE_SEQ_END    0
+#define SPARKLE_SEQ_SET    1
+#define SPARKLE_SEQ_HOLD   2
+#define SPARKLE_SEQ_RAMP   3
+#define SPARKLE_SEQ_JUMP   4
+#define SPARKLE_SEQ_REPEAT 5
+
+#define SPARKLE_SET(level)         SPARKLE_SEQ_SET, (level)
+#define SPARKLE_HOLD(ticks)        SPARKLE_SEQ_HOLD, ((ticks) & 0xFF), \
+                                   (((ticks) >> 8) & 0xFF)
+#define SPARKLE_RAMP(level, ticks) SPARKLE_SEQ_RAMP, (level), \
+                                   ((ticks) & 0xFF), (((ticks) >> 8) & 0xFF)
+#define SPARKLE_JUMP(pos)          SPARKLE_SEQ_JUMP, (pos)
+#define SPARKLE_REPEAT(pos, times) SPARKLE_SEQ_REPEAT, (pos), (times)  // no nesting
+#define SPARKLE_END                SPARKLE_SEQ_END
+
+/**
+ * Most instructions in a row without a HOLD or RAMP that takes time, which
+ * catches a pattern looping on itself.
+ */
+#ifndef SPARKLE_SEQ_MAX_STEPS
+ #define SPARKLE_SEQ_MAX_STEPS 32
+#endif
+#endif
+
+/**
+ * Raw random values a Sparkle works out ahead of time, in spare time (see
+ * Sparkle::idle()), so a random blink edge only takes one from the buffer.
+ * A power of two up to 128, or 0 for none; and the most that update() adds
+ * in one call that has nothing due.
+ */
+#ifdef __LED_BLINK_RANDOM_ENABLED__
+#ifndef SPARKLE_RANDOM_AHEAD
+ #define SPARKLE_RANDOM_AHEAD 8
+#endif
+#ifndef SPARKLE_RANDOM_SLICE
+ #define SPARKLE_RANDOM_SLICE 2
+#endif
+
+/**
+ * Small, fast pseudo-random generator for random blink durations: a 16-bit
+ * xorshift (period 65535), reduced to a range by multiply and shift rather
+ * than modulo. Much cheaper than random() on 8-bit parts. Values can be
+ * worked out ahead into a small buffer with refill(); they come out in the
+ * same order either way, so a seed still gives one pattern.
+ */
+class SparkleRandom {
+  static_assert((SPARKLE_RANDOM_AHEAD <= 128) &&
+                ((SPARKLE_RANDOM_AHEAD & (SPARKLE_RANDOM_AHEAD - 1)) == 0),
+                "SPARKLE_RANDOM_AHEAD must be 0 or a power of two up to 128");
+
+  private:
+  unsigned short state;
+#if SPARKLE_RANDOM_AHEAD > 0
+  unsigned short ahead[SPARKLE_RANDOM_AHEAD];
+  unsigned char first;          // of the values waiting in ahead
+  unsigned char waiting;
+#endif
+
+  /**
+   * Step the generator.
+   */
+  unsigned short generate() {
+    state ^= state << 7;
+    state ^= state >> 9;
+    state ^= state << 8;
+    return state;
+  }
+
+  public:
+  SparkleRandom(): state(0xACE1)
+#if SPARKLE_RANDOM_AHEAD > 0
+                   , ahead(),
+                   first(0),
+                   waiting(0)
+#endif
+                   {
+  }
+
+  /**
+   * Restart the sequence. The same seed always gives the same sequence.
+   */
+  void seed(unsigned short value) {
+    state = value?value:0xACE1;
+#if SPARKLE_RANDOM_AHEAD > 0
+    waiting = 0;
+#endif
+  }
+
+  /**
+   * Next raw 16-bit value: the oldest one worked out ahead, if any.
+   */
+  unsigned short next() {
+#if SPARKLE_RANDOM_AHEAD > 0
+    if (waiting) {
+      unsigned short value = ahead[first];
+      first = (first + 1) & (SPARKLE_RANDOM_AHEAD - 1);
+      waiting--;
+      return value;
+    }
+#endif
+    return generate();
+  }
+
+  /**
+   * Work out up to most values ahead, as far as the buffer has room.
+   */
+  void refill(unsigned char most) {
+#if SPARKLE_RANDOM_AHEAD > 0
+    while (most-- && (waiting < SPARKLE_RANDOM_AHEAD)) {
+      ahead[(first + waiting) & (SPARKLE_RANDOM_AHEAD - 1)] = generate();
+      waiting++;
+    }
+#else
+    (void)most;
+#endif
+  }
+
+  /**
+   * A value from min up to, but not including, max. Like random(), returns
+   * min if max isn't above it.
+   */
+  unsigned short between(unsigned short min, unsigned short max) {
+    if (max <= min) {
+      return min;
+    }
+    return min + (unsigned short)(((unsigned long)next() * (max - min)) >> 16);
+  }
+};
+#endif
+
 /**
  * Interface for all LED types. Cover the basics; later on, add more advanced
  * LED controls that can handle 2- and 3-color LEDs.
+ *
+ * The interface is resolved at compile time: an LED type derives from
+ * ILedDef<itself> and defines each method below, and code written against
+ * ILedDef<Led> calls it directly. There are no virtual calls, so the calls
+ * can be inlined and LEDs carry no vtable pointer.
  */
+template <class Led>
 struct ILedDef {
   /**
    * Initialize the pins, etc.
    */
-  virtual void initPin();
+  void initPin() { led().initPin(); }
 
   /**
    * Turn on the LED. Pay attention to whether it is common cathode or anode.
    */
-  virtual void turnOn();
+  void turnOn() { led().turnOn(); }
 
   /**
    * Turn off the LED. Pay attention to whether it is common cathode or anode.
    */
-  virtual void turnOff();
+  void turnOff() { led().turnOff(); }
 
   /**
    * Get the color.
    */
-  virtual enum LedColor getColor();
+  enum LedColor getColor() { return led().getColor(); }
 
   /**
    * Return whether the LED is on or not.
    */
-  virtual bool isOn();
+  bool isOn() { return led().isOn(); }
 
   /**
    * Call periodically to update the state.
    */
-  virtual void update();
+  void update() { led().update(); }
+
+  protected:
+  Led &led() { return *static_cast<Led *>(this); }
 };
 
 /**
  * LED class. Used by the Sparkle class.
  * Refer to interface ILedDef for base definitions.
  */
-class LedDef : ILedDef {
+class LedDef : public ILedDef<LedDef> {
   private:
+  // The fields every update() reads are packed into two bytes.
   unsigned char pin;
-  enum LedColor color;
-  bool commonCathode;
-  bool pwm;
-  bool ledIsOn;
-  enum DisplayMode displayMode;
+  enum LedColor color : 4;
+  enum DisplayMode displayMode : 4;
+  bool commonCathode : 1;
+  bool pwm : 1;
+  bool ledIsOn : 1;
+#ifdef __LED_FADE_ENABLED__
+  bool fadingUp : 1;
+#endif
+  bool rgb : 1;                 // this is an RgbLedDef
+#ifdef __USE_SPARKLE__
+  bool eventPending : 1;        // turned on or off since the listener ran
+  bool eventWasOn : 1;          // on as the listener last saw it
+#endif
 #ifdef __LED_BLINK_ENABLED__
-  unsigned short blinkOffDuration;
   unsigned short blinkOnDuration;
+  unsigned short blinkOffDuration;
 #endif
 #ifdef __LED_TIMED_ENABLED__
   unsigned short timerDuration;
@@ -125,161 +531,905 @@ class LedDef : ILedDef {
   unsigned short randMaxOffDuration;
   unsigned short randMinOnDuration;
   unsigned short randMaxOnDuration;
-  unsigned short randOffDuration;
-  unsigned short randOnDuration;
+  unsigned short randDuration;  // of the current on or off period
+#endif
+#ifdef __LED_FADE_ENABLED__
+  unsigned char fadeMin;
+  unsigned char fadeMax;
+  unsigned short fadeUpStep;    // 8.8 fixed point levels per tick
+  unsigned short fadeDownStep;
+  unsigned short level;         // 8.8 fixed point brightness
+#endif
+#ifdef __LED_SEQUENCE_ENABLED__
+  const unsigned char *sequence;  // PROGMEM pattern
+  unsigned char pc;             // offset of the current instruction
+  unsigned char seqRepeat;      // repeats left of the current REPEAT
+  unsigned short seqStep;       // 8.8 levels per tick of the current RAMP
 #endif
   unsigned long lastTime;
-
-  protected:
-  void on();
-  void off();
-
-  public:
-  /**
-   * Constructor. Provide which pin, color, and whether the LED is switched using
-   * common cathode or common anode, so that the logic works correctly. Also, set
-   * whether the pin is PWM capable. ("false" is a safe default.)
-   */
-  LedDef(unsigned char ledPin, enum LedColor ledColor,
-         bool ledCommonCathode, bool pwmCapable):
-         pin(ledPin),
-         color(ledColor),
-         commonCathode(ledCommonCathode),
-         pwm(pwmCapable),
-         displayMode(DISABLED),
-#ifdef __LED_BLINK_ENABLED__
-         blinkOnDuration(0),
-         blinkOffDuration(0),
+#ifdef __USE_SPARKLE__
+  Sparkle *owner;
+  unsigned short nextOfColor;   // next LED of the same color in owner
+#ifdef SPARKLE_PORT_IO
+  unsigned char port;
+  SparklePortMask bit;
 #endif
-#ifdef __LED_TIMED_ENABLED__
-         timerDuration(0),
+#ifdef __SPARKLE_STATS_ENABLED__
+  unsigned short maxLateness;
 #endif
-#ifdef __LED_BLINK_RANDOM_ENABLED__
-         randMinOffDuration(0),
-         randMaxOffDuration(0),
-         randMinOnDuration(0),
-         randMaxOnDuration(0),
-         randOffDuration(0),
-         randOnDuration(0),
 #endif
-         lastTime(0) {
-  }
-
-  void initPin();
-  void turnOff();
-  void turnOn();
-  enum LedColor getColor();
-  bool isOn();
-  void update();
 
+#if defined(__USE_SPARKLE__) && defined(__SPARKLE_STATS_ENABLED__)
   /**
-   * Set the blink mode with the duration on and off.
-   * This does not change the mode to BLINK from MANUAL or any other mode. To
-   * do that, call startBlink().
-   * If onDuration or offDuration are zero, both settings are ignored.
+   * Count an on() or off() in the owner's stats: written or suppressed, and
+   * whether the LED changed state.
    */
-#ifdef __LED_BLINK_ENABLED__
-  void setBlink(unsigned short onDuration, unsigned short offDuration);
+  void countWrite(bool written, bool changed);
 #endif
 
   /**
-   * Start blinking, using the parameters set by setBlink.
-   * If setBlink() wasn't called to initialize the blink durations, then
-   * startBlink() doesn't do anything.
+   * Drive the pin to match ledIsOn.
    */
-#ifdef __LED_BLINK_ENABLED__
-  void startBlink();
-#endif
+  void write();
 
   /**
-   * Set the random blink mode with the max/min durations for both on and off.
-   * This does not change the mode to BLINK_RANDOM from MANUAL or any other
-   * mode. To do that, call startRandomBlink().
-   * If any argument is zero, all settings are ignored.
+   * Turn off in MANUAL mode, writing the output even if the LED already
+   * seems off.
    */
-#ifdef __LED_BLINK_RANDOM_ENABLED__
-  void setRandomBlink(unsigned short minOffDuration,
-                      unsigned short maxOffDuration,
-                      unsigned short minOnDuration,
-                      unsigned short maxOnDuration);
-#endif
+  void reset();
 
   /**
-   * Start random blinking, using the parameters set by setRandomBlink.
-   * If setRandomBlink() wasn't called to initialize the blink durations, then
-   * startRandomBlink() doesn't do anything.
+   * Get the time of the LED's next scheduled change. Returns false if it has
+   * nothing scheduled (e.g. MANUAL mode).
    */
-#ifdef __LED_BLINK_RANDOM_ENABLED__
-  void startRandomBlink();
-#endif
+  bool nextEvent(unsigned long &due);
 
   /**
-   * Set the time'd LED's duration.
-   * This does not change the mode to TIMED from MANUAL or any other mode. To
-   * do that, call startTimer().
-   * If duration is zero, the setting is ignored.
+   * Tell the owning Sparkle (if any) that the schedule changed.
    */
-#ifdef __LED_TIMED_ENABLED__
-  void setTimer(unsigned short duration);
-#endif
+  void reschedule();
 
   /**
-   * Turn on the LED for the duration set in setTimer.
-   * If setTimer() wasn't called to initialize the duration, then
-   * startTimer() doesn't do anything.
+   * Whether the pin is showing a fade level rather than plain on/off.
    */
-  void startTimer();
-};
-
-
-/**
- * The Sparkle class manages LEDs that are assigned to it. Enables more complex behaviors,
- * especially in groups.
- */
-#ifdef __USE_SPARKLE__
-class Sparkle {
-  private:
-  LedDef *leds;
-  unsigned char count;
+  bool isFading() {
+#ifdef __LED_SEQUENCE_ENABLED__
+    return (displayMode == FADE) || ((displayMode == SEQUENCE) && canFade());
+#elif defined(__LED_FADE_ENABLED__)
+    return (displayMode == FADE);
+#else
+    return false;
+#endif
+  }
 
-  public:
   /**
-   * Constructor.
-   * ledList is a list of ledDef LEDs defined for the class to control.
+   * Current time on the owning Sparkle's timebase, or millis() for a
+   * standalone LED.
    */
-  template <size_t ledCount>
-  Sparkle(LedDef (&ledList)[ledCount])  {
-    leds = ledList;
-    count = sizeof(ledList) / sizeof(LedDef);
-  }
+  unsigned long currentTime();
 
   /**
-   * Used to set the list of LEDs to manage to digital output.
+   * Shortest time between two level changes: the owning Sparkle's frame
+   * interval, or 1 tick for a standalone LED.
    */
-  void initPins();
+  unsigned short frameTicks();
 
   /**
-   * Turn off all managed LEDs.
+   * Scale a PWM duty by the owning Sparkle's global brightness.
    */
-  void allOff();
+  unsigned char dim(unsigned char duty);
 
+#ifdef __LED_BLINK_RANDOM_ENABLED__
   /**
-   * Turn on all managed LEDs.
+   * A random duration from min up to, but not including, max. Uses the
+   * owning Sparkle's generator, or random() for a standalone LED.
    */
-  void allOn();
+  unsigned short randomBetween(unsigned short min, unsigned short max);
+#endif
+
+#ifdef __LED_FADE_ENABLED__
+  /**
+   * Output the current fade level, gamma corrected.
+   */
+  void writeLevel();
+
+  /**
+   * Whether the LED fades with analogWrite(), as opposed to software PWM.
+   */
+  bool usesAnalog();
+
+  /**
+   * Whether the LED can show fade levels at all.
+   */
+  bool canFade() {
+    return pwm || !usesAnalog();
+  }
+#endif
+
+#ifdef __LED_SEQUENCE_ENABLED__
+  /**
+   * Run the pattern from pc up to the next instruction that takes time. skip
+   * is how far past the start of that instruction the pattern already is.
+   */
+  void runSequence(unsigned long now, unsigned long skip);
+
+  /**
+   * Move the level of the current RAMP by delta ticks. Returns true when it
+   * reached the target, with delta then the ticks left over past that.
+   */
+  bool stepRamp(unsigned long &delta);
+
+  /**
+   * Output the sequence level: as a fade level, or on/off if the LED can't
+   * fade.
+   */
+  void showLevel();
+#endif
+
+  /**
+   * Note an on() or off() for the owner's listener, which hears of it once
+   * the change is complete. wasOn is the state before it.
+   */
+#ifdef __USE_SPARKLE__
+  void noteEvent(bool wasOn);
+#endif
+
+  /**
+   * Set whether the LED is on without writing it, e.g. for a fade level,
+   * noting a change for the listener as on() and off() do.
+   */
+  void setLit(bool lit);
+
+  /**
+   * Hold the owner's output around a public call, so its listener only
+   * hears of the changes once the call is done, and end the hold.
+   */
+  void holdOwner();
+  void commitOwner();
+
+  /**
+   * update(now) for an owner that already holds its output.
+   */
+  void step(unsigned long now);
+
+  /**
+   * Bytes of the LED's record in a Sparkle::saveState() blob.
+   */
+#ifdef __USE_SPARKLE__
+  unsigned char stateBytes();
+
+  /**
+   * Write the LED's record at at and move at past it, or read it back.
+   * Sequences and groups are saved as MANUAL, as they live outside the LED.
+   */
+  void saveState(unsigned char *&at);
+  void loadState(const unsigned char *&at);
+
+  /**
+   * Make the pins that Sparkle doesn't batch outputs, and show the loaded
+   * state.
+   */
+  void restore();
+#endif
+
+  protected:
+  void on();
+  void off();
+
+  public:
+  /**
+   * Constructor. Provide which pin, color, and whether the LED is switched using
+   * common cathode or common anode, so that the logic works correctly. Also, set
+   * whether the pin is PWM capable. ("false" is a safe default.)
+   */
+  LedDef(unsigned char ledPin, enum LedColor ledColor,
+         bool ledCommonCathode, bool pwmCapable):
+         pin(ledPin),
+         color(ledColor),
+         displayMode(DISABLED),
+         commonCathode(ledCommonCathode),
+         pwm(pwmCapable),
+         ledIsOn(false),
+#ifdef __LED_FADE_ENABLED__
+         fadingUp(false),
+#endif
+         rgb(false),
+#ifdef __LED_BLINK_ENABLED__
+         blinkOnDuration(0),
+         blinkOffDuration(0),
+#endif
+#ifdef __LED_TIMED_ENABLED__
+         timerDuration(0),
+#endif
+#ifdef __LED_BLINK_RANDOM_ENABLED__
+         randMinOffDuration(0),
+         randMaxOffDuration(0),
+         randMinOnDuration(0),
+         randMaxOnDuration(0),
+         randDuration(0),
+#endif
+#ifdef __LED_FADE_ENABLED__
+         fadeMin(0),
+         fadeMax(0),
+         fadeUpStep(0),
+         fadeDownStep(0),
+         level(0),
+#endif
+#ifdef __LED_SEQUENCE_ENABLED__
+         sequence(0),
+         pc(0),
+         seqRepeat(0),
+         seqStep(0),
+#endif
+         lastTime(0)
+#ifdef __USE_SPARKLE__
+         , owner(0),
+         nextOfColor(SPARKLE_NO_LED)
+#ifdef SPARKLE_PORT_IO
+         , port(SPARKLE_NO_PORT),
+         bit(0)
+#endif
+#ifdef __SPARKLE_STATS_ENABLED__
+         , maxLateness(0)
+#endif
+#endif
+         {
+#ifdef __USE_SPARKLE__
+    eventPending = false;
+    eventWasOn = false;
+#endif
+  }
+
+  void initPin();
+  void turnOff();
+  void turnOn();
+  enum LedColor getColor();
+  bool isOn();
+  void update();
+
+  /**
+   * Update the state as of time now, e.g. one time sample shared by many LEDs.
+   */
+  void update(unsigned long now);
+
+  /**
+   * Most ticks a change of this LED came after its due time, since the
+   * owning Sparkle's last resetStats() (up to 65535).
+   */
+#if defined(__USE_SPARKLE__) && defined(__SPARKLE_STATS_ENABLED__)
+  unsigned short getMaxLateness() {
+    return maxLateness;
+  }
+#endif
+
+  /**
+   * Set the blink mode with the duration on and off.
+   * This does not change the mode to BLINK from MANUAL or any other mode. To
+   * do that, call startBlink(). A blinking LED uses the new durations from
+   * its current on or off period.
+   * If onDuration or offDuration are zero, both settings are ignored.
+   */
+#ifdef __LED_BLINK_ENABLED__
+  void setBlink(unsigned short onDuration, unsigned short offDuration);
+#endif
+
+  /**
+   * Start blinking, using the parameters set by setBlink.
+   * If setBlink() wasn't called to initialize the blink durations, then
+   * startBlink() doesn't do anything.
+   */
+#ifdef __LED_BLINK_ENABLED__
+  void startBlink();
+#endif
+
+  /**
+   * Set the random blink mode with the max/min durations for both on and off.
+   * This does not change the mode to BLINK_RANDOM from MANUAL or any other
+   * mode. To do that, call startRandomBlink().
+   * If any argument is zero, all settings are ignored.
+   */
+#ifdef __LED_BLINK_RANDOM_ENABLED__
+  void setRandomBlink(unsigned short minOffDuration,
+                      unsigned short maxOffDuration,
+                      unsigned short minOnDuration,
+                      unsigned short maxOnDuration);
+#endif
+
+  /**
+   * Start random blinking, using the parameters set by setRandomBlink.
+   * If setRandomBlink() wasn't called to initialize the blink durations, then
+   * startRandomBlink() doesn't do anything.
+   */
+#ifdef __LED_BLINK_RANDOM_ENABLED__
+  void startRandomBlink();
+#endif
+
+  /**
+   * Set the time'd LED's duration.
+   * This does not change the mode to TIMED from MANUAL or any other mode. To
+   * do that, call startTimer(). A running timer ends duration after it
+   * was started.
+   * If duration is zero, the setting is ignored.
+   */
+#ifdef __LED_TIMED_ENABLED__
+  void setTimer(unsigned short duration);
+#endif
+
+  /**
+   * Turn on the LED for the duration set in setTimer.
+   * If setTimer() wasn't called to initialize the duration, then
+   * startTimer() doesn't do anything.
+   */
+#ifdef __LED_TIMED_ENABLED__
+  void startTimer();
+#endif
+
+  /**
+   * Set the fade mode: the brightness range (0-255) and the time in
+   * milliseconds to fade up and back down. Brightness is gamma corrected, so
+   * levels are perceptually even.
+   * This does not change the mode to FADE from MANUAL or any other mode. To
+   * do that, call startFade().
+   * If upDuration or downDuration are zero, or minLevel isn't below maxLevel,
+   * all settings are ignored.
+   */
+#ifdef __LED_FADE_ENABLED__
+  void setFade(unsigned char minLevel, unsigned char maxLevel,
+               unsigned short upDuration, unsigned short downDuration);
+#endif
+
+  /**
+   * Start fading up and down continuously, using the parameters set by
+   * setFade(). Only PWM capable pins can fade, unless the LED's Sparkle has a
+   * SparkleBam attached (see SparkleBam.h).
+   * If setFade() wasn't called to initialize the fade, then startFade()
+   * doesn't do anything.
+   */
+#ifdef __LED_FADE_ENABLED__
+  void startFade();
+#endif
+
+  /**
+   * Play a PROGMEM pattern (see SPARKLE_SET() and friends). A pattern holds no
+   * state of its own, so any number of LEDs can share one; phase starts the
+   * pattern that many ticks in, e.g. to run LEDs of a chase apart.
+   * If pattern is 0, this doesn't do anything.
+   */
+#ifdef __LED_SEQUENCE_ENABLED__
+  void startSequence(const unsigned char *pattern, unsigned short phase = 0);
+#endif
+
+#ifdef __USE_SPARKLE__
+  friend class Sparkle;
+#ifdef __SPARKLE_GROUP_ENABLED__
+  friend class SparkleGroup;
+#endif
+#endif
+  friend class RgbLedDef;
+};
+
+/**
+ * A 3-color (RGB) LED. It works like a LedDef, with one set of modes and
+ * timers for all three channels: when the LED is on, or at its current fade
+ * level, it shows its color. Each channel fades with analogWrite() if
+ * pwmCapable is set, or with an attached SparkleBam; otherwise a channel is
+ * simply on when its color value is 128 or more.
+ * A Sparkle manages either LedDefs or RgbLedDefs; use one of each to mix
+ * them.
+ */
+class RgbLedDef : public LedDef {
+  private:
+  unsigned char greenPin;
+  unsigned char bluePin;
+  unsigned char red;
+  unsigned char green;
+  unsigned char blue;
+#ifdef SPARKLE_PORT_IO
+  unsigned char greenPort;
+  unsigned char bluePort;
+  SparklePortMask greenBit;
+  SparklePortMask blueBit;
+#endif
+
+  /**
+   * Show the color at the given brightness (0-255, after gamma).
+   */
+  void writeRgb(unsigned char duty);
+
+  /**
+   * Output one channel.
+   */
+  void writeChannel(unsigned char channelPin, unsigned char channelPort,
+                    SparklePortMask channelBit, unsigned char value);
+
+  /**
+   * Show the color again after it changed.
+   */
+  void refresh();
+
+  public:
+  /**
+   * Constructor. Provide the three pins, whether the LED is switched using
+   * common cathode or common anode, and whether all three pins are PWM
+   * capable. RGB LEDs belong to the WHITE color group and start out white.
+   */
+  RgbLedDef(unsigned char redPin, unsigned char ledGreenPin,
+            unsigned char ledBluePin, bool ledCommonCathode, bool pwmCapable):
+            LedDef(redPin, WHITE, ledCommonCathode, pwmCapable),
+            greenPin(ledGreenPin),
+            bluePin(ledBluePin),
+            red(255),
+            green(255),
+            blue(255)
+#ifdef SPARKLE_PORT_IO
+            , greenPort(SPARKLE_NO_PORT),
+            bluePort(SPARKLE_NO_PORT),
+            greenBit(0),
+            blueBit(0)
+#endif
+            {
+    rgb = true;
+  }
+
+  /**
+   * Set the color from red, green and blue values (0-255).
+   */
+  void setRgb(unsigned char r, unsigned char g, unsigned char b);
+
+  /**
+   * Set the color from hue, saturation and value (0-255 each). Integer only.
+   */
+  void setHsv(unsigned char hue, unsigned char saturation,
+              unsigned char value);
+
+#ifdef __USE_SPARKLE__
+  friend class Sparkle;
+#endif
+  friend class LedDef;
+};
+
+
+/**
+ * A set of a Sparkle's LEDs for its bulk calls, e.g. sparkle.startBlink():
+ * a range of list positions, a mask of colors, or a bitset with one bit per
+ * LED (bit i & 7 of byte i >> 3 for LED i). The bitset is not copied, so it
+ * must outlive the selector.
+ *
+ *   sparkle.setBlink(SparkleSelector::range(0, 64), 100, 400);
+ *   sparkle.startBlink(SparkleSelector::colors(SPARKLE_COLOR(RED) |
+ *                                              SPARKLE_COLOR(BLUE)));
+ */
+#ifdef __USE_SPARKLE__
+#define SPARKLE_COLOR(color) (1U << (color))
+
+class SparkleSelector {
+  private:
+  enum Kind {
+    RANGE,
+    COLORS,
+    BITS
+  };
+
+  unsigned char kind;
+  unsigned short first;         // of a range
+  unsigned short size;          // LEDs in a range, or bits in a bitset
+  unsigned short colorMask;
+  const unsigned char *bits;
+
+  SparkleSelector(unsigned char selectorKind, unsigned short firstLed,
+                  unsigned short selectorSize, unsigned short mask,
+                  const unsigned char *set):
+                  kind(selectorKind),
+                  first(firstLed),
+                  size(selectorSize),
+                  colorMask(mask),
+                  bits(set) {
+  }
+
+  public:
+  /**
+   * ledCount LEDs of the list from index firstLed on.
+   */
+  static SparkleSelector range(unsigned short firstLed,
+                               unsigned short ledCount) {
+    return SparkleSelector(RANGE, firstLed, ledCount, 0, 0);
+  }
+
+  /**
+   * The LEDs of the colors in mask, made of SPARKLE_COLOR() bits. Only the
+   * LEDs of those colors are visited.
+   */
+  static SparkleSelector colors(unsigned short mask) {
+    return SparkleSelector(COLORS, 0, 0, mask, 0);
+  }
+
+  /**
+   * The LEDs whose bits are set among the first setSize bits of set.
+   */
+  static SparkleSelector set(const unsigned char *set, unsigned short setSize) {
+    return SparkleSelector(BITS, 0, setSize, 0, set);
+  }
+
+  friend class Sparkle;
+};
+#endif
+
+/**
+ * The Sparkle class manages LEDs that are assigned to it. Enables more complex behaviors,
+ * especially in groups.
+ */
+#ifdef __USE_SPARKLE__
+class Sparkle {
+  private:
+  LedDef *leds;
+  unsigned char stride;         // sizeof the LED type in leds
+  unsigned short count;
+  unsigned short firstOfColor[SPARKLE_COLORS];
+  SparkleFrame *frame;
+  unsigned char holds;
+  SparkleClock clock;
+  unsigned long nextDue;
+  bool scheduled;
+  unsigned short cursor;        // where updateBudget() resumes
+#ifdef __SPARKLE_GROUP_ENABLED__
+  SparkleGroup *groups;
+#endif
+#ifdef __LED_BLINK_RANDOM_ENABLED__
+  SparkleRandom rng;
+#endif
+#ifdef __SPARKLE_STATS_ENABLED__
+  SparkleStats stats;
+
+  /**
+   * Note how late LED i is, if it is due at now.
+   */
+  void countLateness(unsigned short i, unsigned long now);
+#endif
+
+  /**
+   * Fold an LED's next event into the cached earliest deadline.
+   */
+  void schedule(LedDef &led);
+  void schedule(unsigned long due);
+
+#ifdef SPARKLE_PORT_IO
+  /**
+   * A group of LEDs sharing one output port. state holds the lit LEDs; invert
+   * holds the LEDs that are lit by driving the pin LOW (common anode), so the
+   * register value is simply state ^ invert. changed holds the LEDs written
+   * during a hold, which are the only bits commit() writes.
+   */
+  struct LedPort {
+    volatile SparklePortMask *out;
+    volatile SparklePortMask *mode;   // the direction register
+    SparklePortMask mask;
+    SparklePortMask invert;
+    SparklePortMask state;
+    SparklePortMask changed;
+    SparklePortMask shown;      // lit LEDs allowed on by the power budget
+  };
+  LedPort ports[SPARKLE_MAX_PORTS];
+  unsigned char portCount;
+
+  /**
+   * Bit planes of an attached SparkleBam, or 0. While attached, the BAM
+   * interrupt owns the port registers and LED changes only edit the planes.
+   */
+  SparklePortMask (*bamPlanes)[8];
+
+  /**
+   * Update the shadow state of one LED and mark it changed; write it through
+   * unless held.
+   */
+  void writePort(unsigned char port, SparklePortMask bit, bool lit);
+
+  /**
+   * Set the software PWM duty of one LED in the BAM bit planes.
+   */
+  void writePortLevel(unsigned char port, SparklePortMask bit,
+                      unsigned char duty);
+
+  /**
+   * Write the masked bits of a port from its shadow state.
+   */
+  void flushPort(LedPort &port, SparklePortMask bits);
+
+  /**
+   * Add a pin to the port groups. Returns its port index, or SPARKLE_NO_PORT.
+   */
+  unsigned char groupPin(unsigned char pin, bool commonCathode,
+                         SparklePortMask &bit);
+
+  /**
+   * Add all pins of an LED to the port groups.
+   */
+  void groupLed(LedDef &led);
+
+  /**
+   * Take a pin out of its port group, so its bit is no longer written.
+   */
+  void ungroupPin(unsigned char port, SparklePortMask bit);
+
+  /**
+   * Take all pins of an LED out of the port groups.
+   */
+  void ungroupLed(LedDef &led);
+
+  /**
+   * Most port-batched LEDs lit at once (0 for no limit), where this frame's
+   * share of them starts, when the share moves on, and whether the budget is
+   * in force.
+   */
+  unsigned short maxLit;
+  unsigned short shareStart;
+  unsigned long shareDue;
+  bool overBudget;
+
+  /**
+   * Choose which lit LEDs the ports show this frame under the budget.
+   * Returns true if that may have changed the shown masks.
+   */
+  bool share();
+#endif
+
+  /**
+   * What to call when an LED turns on or off, or 0, and its context.
+   */
+  SparkleListener listener;
+  void *listenerContext;
+  bool eventsPending;           // an LED has an event for the listener
+
+  /**
+   * The LEDs with an event, in the order they had it. More than
+   * SPARKLE_EVENT_QUEUE of them is an overflow: look through all LEDs.
+   */
+  LedDef *eventQueue[SPARKLE_EVENT_QUEUE];
+  unsigned char queued;
+
+  /**
+   * Remember that led has an event for the listener.
+   */
+  void queueEvent(LedDef &led);
+
+  /**
+   * Tell the listener about the LEDs that turned on or off during the hold
+   * that just ended.
+   */
+  void deliverEvents();
+
+  /**
+   * Global brightness of levels (0-255), and the shortest time between two
+   * level changes of an LED.
+   */
+  unsigned char brightness;
+  unsigned short frameInterval;
+
+  /**
+   * Scale a PWM duty by the global brightness. (duty * (brightness + 1)) >> 8
+   * is exact at both ends.
+   */
+  unsigned char dim(unsigned char duty) {
+    return ((unsigned short)duty * (brightness + 1)) >> 8;
+  }
+
+  /**
+   * The time shared by the LEDs of a bulk call, while timeSampled is set.
+   */
+  unsigned long sampledTime;
+  bool timeSampled;
+
+  /**
+   * Current time on the timebase, or the bulk call's sample.
+   */
+  unsigned long now() {
+    return timeSampled?sampledTime:clock();
+  }
+
+  /**
+   * What a bulk call does to each selected LED.
+   */
+  enum SelectOp {
+    SELECT_ON,
+    SELECT_OFF,
+    SELECT_SET_BLINK,
+    SELECT_START_BLINK,
+    SELECT_SET_TIMER,
+    SELECT_START_TIMER,
+    SELECT_SET_FADE,
+    SELECT_START_FADE
+  };
+
+  /**
+   * Do op to every selected LED, with one time sample and one commit.
+   */
+  void select(const SparkleSelector &leds, unsigned char op,
+              unsigned short a = 0, unsigned short b = 0,
+              unsigned char low = 0, unsigned char high = 0);
+
+  /**
+   * Do op to one LED. model is the first LED set up by a SELECT_SET_FADE,
+   * whose fade steps the rest copy, or 0.
+   */
+  void selectOne(LedDef &led, unsigned char op, LedDef *&model,
+                 unsigned short a, unsigned short b,
+                 unsigned char low, unsigned char high);
+
+  /**
+   * Claim the LEDs and index them by color. Called by the constructor.
+   */
+  void init();
+
+  /**
+   * Claim the LEDs and rebuild the per-color lists, e.g. after LEDs moved.
+   */
+  void reindex();
+
+  /**
+   * Claim LED i and add it to the front of its color's list, or take it out
+   * of that list.
+   */
+  void linkColor(unsigned short i);
+  void unlinkColor(unsigned short i);
+
+  /**
+   * Whether LEDs may move within the list (a SparklePool), which rules out
+   * frames, as their bits are wired by list position.
+   */
+  bool movable;
+
+  /**
+   * LED i of the list, whatever the LED type.
+   */
+  LedDef &led(unsigned short i) {
+    return *(LedDef *)((unsigned char *)leds + i * stride);
+  }
+
+  /**
+   * Set one LED's output bit in the attached frame.
+   */
+  void writeFrame(LedDef &led);
+
+  /**
+   * Set one LED's pixel in the attached pixel frame to its color at the
+   * given brightness (0-255, after gamma).
+   */
+  void writePixel(LedDef &led, unsigned char duty);
+
+#ifdef __SPARKLE_GROUP_ENABLED__
+  /**
+   * Update the groups that are due and schedule their next changes.
+   */
+  void updateGroups(unsigned long now);
+#endif
+
+  protected:
+  /**
+   * Constructor for a list that is managed elsewhere (see SparklePool):
+   * ledCount LEDs, ledStride bytes apart.
+   */
+  Sparkle(LedDef *ledList, unsigned char ledStride, unsigned short ledCount):
+          leds(ledList),
+          stride(ledStride),
+          count(ledCount) {
+    sparkleFeatureCheck(SparkleFeatureSet<SPARKLE_FEATURES>());
+    init();
+  }
+
+  public:
+  /**
+   * Constructor.
+   * ledList is a list of LedDef (or RgbLedDef) LEDs defined for the class to
+   * control.
+   */
+  template <class Led, size_t ledCount>
+  Sparkle(Led (&ledList)[ledCount])  {
+    leds = ledList;
+    stride = sizeof(Led);
+    count = sizeof(ledList) / sizeof(Led);
+    sparkleFeatureCheck(SparkleFeatureSet<SPARKLE_FEATURES>());
+    init();
+  }
+
+  /**
+   * Used to set the list of LEDs to manage to digital output. This also groups
+   * the LEDs by port, so call it again if you change any LED's pin.
+   * With a frame attached, the LEDs are only turned off.
+   */
+  void initPins();
+
+  /**
+   * Drive the LEDs through a framebuffer instead of MCU pins: LED i of the
+   * list is bit i of the frame, and the LEDs' pin numbers are not used.
+   * Attach before calling initPins(). Normally called by the backend, e.g.
+   * SparkleShift::begin(). Ignored if the frame is smaller than the list,
+   * the list is a SparklePool, or it holds RgbLedDefs and the frame has no
+   * pixels.
+   */
+  void attach(SparkleFrame &output);
+
+  /**
+   * Save the mode and settings of every LED (durations, fade range and
+   * level, on or off, RGB color) into blob, e.g. to write to EEPROM (see
+   * SparkleEeprom.h). Returns the bytes used, stateSize(), or 0 if size is
+   * too small.
+   */
+  unsigned short saveState(unsigned char *blob, unsigned short size);
+
+  /**
+   * Bring the LEDs back as saveState() left them, instead of initPins(): the
+   * modes restart their current period now, and port-batched pins are set up
+   * with one PORT and one DDR write per port. Returns false, changing
+   * nothing, if the blob is damaged or from another version, feature set or
+   * LED list; call initPins() then.
+   */
+  bool loadState(const unsigned char *blob, unsigned short size);
+
+  /**
+   * Bytes of a saveState() blob for these LEDs.
+   */
+  unsigned short stateSize();
+
+  /**
+   * Hold back LED output until the matching commit(). While held, changes to
+   * the managed LEDs (from Sparkle or from their LedDef methods) only update
+   * shadow state; commit() then writes just the pins that changed, once per
+   * port. Holds nest. Sparkle's own bulk calls and update() hold and commit
+   * internally.
+   */
+  void hold();
+  void commit();
+
+  /**
+   * Turn off all managed LEDs.
+   */
+  void allOff();
+
+  /**
+   * Turn on all managed LEDs.
+   */
+  void allOn();
 
   /**
-   * Turn on all LEDs of a particular color.
+   * Turn on all LEDs of a particular color. Only the LEDs of that color are
+   * visited.
    * color to turn on.
    */
    void turnOnAllColor(enum LedColor color);
 
   /**
-   * Turn off all LEDs of a particular color.
+   * Turn off all LEDs of a particular color. Only the LEDs of that color are
+   * visited.
    * color to turn off.
    */
    void turnOffAllColor(enum LedColor color);
 
+  /**
+   * Turn on or off the selected LEDs (see SparkleSelector).
+   */
+   void turnOn(const SparkleSelector &leds);
+   void turnOff(const SparkleSelector &leds);
+
+  /**
+   * The LedDef calls of the same names, for all selected LEDs at once. The
+   * start calls use one time sample, so the LEDs start in step, and all
+   * pin changes go out in one write per port.
+   */
+#ifdef __LED_BLINK_ENABLED__
+   void setBlink(const SparkleSelector &leds, unsigned short onDuration,
+                 unsigned short offDuration);
+   void startBlink(const SparkleSelector &leds);
+#endif
+#ifdef __LED_TIMED_ENABLED__
+   void setTimer(const SparkleSelector &leds, unsigned short duration);
+   void startTimer(const SparkleSelector &leds);
+#endif
+#ifdef __LED_FADE_ENABLED__
+   void setFade(const SparkleSelector &leds, unsigned char minLevel,
+                unsigned char maxLevel, unsigned short upDuration,
+                unsigned short downDuration);
+   void startFade(const SparkleSelector &leds);
+#endif
+
   /**
    * Set the random blink mode with the max/min durations for both on and off.
    * This does not start the LEDs blinking randomly. To do that, call
@@ -302,10 +1452,194 @@ class Sparkle {
 #endif
 
   /**
-   * Update the status of the LEDs under Sparkle control.
+   * Seed the generator behind all random blink durations of the managed LEDs.
+   * The same seed gives the same pattern, e.g. for testing; seed from an
+   * unconnected analog pin for a different pattern on every boot.
+   */
+#ifdef __LED_BLINK_RANDOM_ENABLED__
+  void seed(unsigned short value);
+#endif
+
+  /**
+   * Update the status of the LEDs under Sparkle control. This is a single
+   * time check until the earliest LED deadline comes due.
    */
    void update();
+
+  /**
+   * Update the status of the LEDs as of time now, on this Sparkle's timebase.
+   * The time is sampled once for the whole pass.
+   */
+   void update(unsigned long now);
+
+  /**
+   * Update at most maxLeds (up to SPARKLE_MAX_SLICE) of the LEDs that are
+   * due, most overdue first, and leave the rest for the next call. This bounds
+   * the cost of one call when many LEDs come due at once. Ties resume from
+   * where the previous call stopped.
+   */
+   void updateBudget(unsigned char maxLeds);
+
+  /**
+   * Ticks until the next scheduled LED change: 0 if one is due now, or
+   * SPARKLE_NO_EVENT if nothing is scheduled.
+   */
+   unsigned long nextEventIn();
+
+  /**
+   * Do background work in spare time, e.g. just before sleeping (as
+   * SparkleSleep does): fill the lookahead of random blink durations (see
+   * SPARKLE_RANDOM_AHEAD). update() also adds a few when nothing is due.
+   */
+   void idle();
+
+  /**
+   * Set the clock that all timing of the managed LEDs is measured in, e.g.
+   * micros for sub-millisecond blink rates. Durations are then in its ticks.
+   * Running modes restart their current period.
+   */
+   void setTimebase(SparkleClock timebase);
+
+  /**
+   * Scale the brightness (0-255) of everything shown as a level: fades,
+   * sequences, RGB colors and LEDs on a SparkleBam. Plain on/off outputs
+   * can't be dimmed; limit them with setMaxLit().
+   */
+   void setBrightness(unsigned char level);
+
+  /**
+   * Let at most leds of the port-batched LEDs be lit at once, e.g. to keep
+   * allOn() from browning out the supply (0, the default, for no limit).
+   * When more are on, each frame shows a different leds-sized share of them
+   * in turn, so all of them light up for an even part of the time. Not
+   * applied while a SparkleBam drives the ports.
+   */
+#ifdef SPARKLE_PORT_IO
+   void setMaxLit(unsigned short leds);
+#endif
+
+  /**
+   * Change fade and sequence levels at most once every ticks ticks (1, the
+   * default, for every tick), e.g. no faster than the PWM can show them.
+   * This is also how often the setMaxLit() share moves on.
+   */
+   void setFrameInterval(unsigned short ticks);
+
+  /**
+   * Call listener(led, on, context) whenever a managed LED turns on or off,
+   * e.g. when a timer runs out or a blink edge comes; 0 stops the calls.
+   * The calls come once the update() pass or LED call that made the changes
+   * is done and its output is written, so the LEDs are in their new modes
+   * and the listener may change them freely, e.g. start a timer again. An
+   * LED that turned on and back off within one pass isn't reported. Fade
+   * and sequence levels don't count, only on and off.
+   * The listener runs wherever update() does: with SparkleIsr, inside the
+   * timer interrupt, so keep it short there and use no Serial or delay().
+   */
+   void setListener(SparkleListener callback, void *context = 0);
+
+  /**
+   * Hot path counters since the last resetStats(). Only with
+   * __SPARKLE_STATS_ENABLED__ defined; without it, nothing is counted and
+   * none of this is compiled in.
+   */
+#ifdef __SPARKLE_STATS_ENABLED__
+   const SparkleStats &getStats() {
+     return stats;
+   }
+
+   void resetStats();
+#endif
+
+  friend class LedDef;
+  friend class RgbLedDef;
+#ifdef __SPARKLE_GROUP_ENABLED__
+  friend class SparkleGroup;
+#endif
+#ifdef SPARKLE_PORT_IO
+  friend class SparkleBam;
+#endif
+  template <unsigned short capacity, class Led> friend class SparklePool;
+  friend class SparkleProtocol;
+};
+
+/**
+ * A run of a Sparkle's LEDs that blink together from one shared timer,
+ * instead of each keeping its own. All members change in the same pass, in
+ * one write per port, and never drift apart. Members can also run a fixed
+ * spacing apart for chase effects.
+ *
+ *   Sparkle sparkle(leds);
+ *   SparkleGroup sign(sparkle, 0, 20);   // leds[0] to leds[19]
+ *
+ *   void setup() {
+ *     sparkle.initPins();
+ *     sign.setBlink(500, 500);
+ *     sign.startBlink(50);   // each LED 50ms behind the previous one
+ *   }
+ *
+ * Members are in GROUPED mode while the group runs; giving a member another
+ * mode (e.g. with turnOn()) takes it out of the group until the next
+ * startBlink(). Declare groups after their Sparkle.
+ */
+#ifdef __SPARKLE_GROUP_ENABLED__
+class SparkleGroup {
+  private:
+  Sparkle &sparkle;
+  SparkleGroup *next;           // in the Sparkle's list of groups
+  unsigned short first;
+  unsigned short size;
+  unsigned short onDuration;
+  unsigned short period;        // on and off duration
+  unsigned short spacing;
+  unsigned short phase;         // ticks into the period of the first member
+  unsigned short wait;          // ticks from lastTime to the next change
+  unsigned long lastTime;
+  bool running;
+
+  /**
+   * Show every member's state for the current phase, and work out when the
+   * next one changes.
+   */
+  void show();
+
+  /**
+   * Advance the phase as of time now, if a member is due to change.
+   */
+  void update(unsigned long now);
+
+  public:
+  /**
+   * Constructor. The group is the memberCount LEDs of sparkle's list from
+   * index firstLed on, in chase order.
+   */
+  SparkleGroup(Sparkle &owner, unsigned short firstLed,
+               unsigned short memberCount);
+
+  /**
+   * Set the blink durations on and off, shared by all members.
+   * This does not start the group. To do that, call startBlink().
+   * If onDuration or offDuration are zero, or they add up to more than
+   * 65535, both settings are ignored.
+   */
+  void setBlink(unsigned short onDuration, unsigned short offDuration);
+
+  /**
+   * Put the members in GROUPED mode and start blinking, each member
+   * memberSpacing ticks behind the one before it (0 for all in step).
+   * If setBlink() wasn't called to initialize the blink durations, then
+   * startBlink() doesn't do anything.
+   */
+  void startBlink(unsigned short memberSpacing = 0);
+
+  /**
+   * Stop the group and turn off the members still in it.
+   */
+  void stop();
+
+  friend class Sparkle;
 };
+#endif
 #endif //__USE_SPARKLE__
 
 #endif
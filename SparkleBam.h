@@ -0,0 +1,110 @@
+/**
+ * Software PWM for Sparkle using bit-angle modulation (BAM).
+ *
+ * SparkleBam gives every port-batched LED of a Sparkle 8-bit brightness, so
+ * FADE works on pins without hardware PWM. Each duty value is split into 8 bit
+ * planes per port; a timer interrupt shows plane b for 2^b time units, which
+ * makes a 255 unit frame. Every interrupt costs one register write per port
+ * in use, no matter how many LEDs there are.
+ *
+ * Include this header from your sketch only, since it can define the timer
+ * interrupt. On AVR parts with Timer2, begin() takes over Timer2 (its PWM pins
+ * and tone() stop working) and SPARKLE_BAM_ISR(bam) defines the interrupt:
+ *
+ *   Sparkle sparkle(leds);
+ *   SparkleBam bam(sparkle);
+ *   SPARKLE_BAM_ISR(bam)
+ *
+ *   void setup() {
+ *     sparkle.initPins();
+ *     bam.begin();
+ *   }
+ *
+ * On other parts, call tick() from your own timer interrupt and wait the
+ * number of time units it returns before the next call.
+ */
+
+#ifndef _SPARKLE_BAM_H_
+#define _SPARKLE_BAM_H_
+
+#include "Sparkle.h"
+
+#ifdef SPARKLE_PORT_IO
+class SparkleBam {
+  private:
+  Sparkle &sparkle;
+  SparklePortMask planes[SPARKLE_MAX_PORTS][8];
+  unsigned char plane;
+
+  public:
+  /**
+   * Constructor. sparkle is the Sparkle whose LEDs are modulated.
+   */
+  SparkleBam(Sparkle &target): sparkle(target), plane(0) {
+  }
+
+  /**
+   * Take over the Sparkle's ports (call after Sparkle::initPins()), and start
+   * the timer where supported. LEDs keep their current on/off state.
+   */
+  void begin() {
+    for (unsigned char p=0; p<sparkle.portCount; p++) {
+      for (unsigned char b=0; b<8; b++) {
+        planes[p][b] = sparkle.ports[p].state;
+      }
+    }
+    plane = 0;
+    sparkle.bamPlanes = planes;
+#if defined(TIMSK2) && defined(OCIE2A)
+    // CTC mode, clk/128: 8us units and a ~490Hz frame at 16MHz.
+    TCCR2A = _BV(WGM21);
+    TCCR2B = _BV(CS22) | _BV(CS20);
+    TCNT2 = 0;
+    OCR2A = 0;
+    TIMSK2 |= _BV(OCIE2A);
+#endif
+  }
+
+  /**
+   * Stop the timer and hand the ports back to Sparkle. Faded LEDs are shown
+   * fully on.
+   */
+  void end() {
+#if defined(TIMSK2) && defined(OCIE2A)
+    TIMSK2 &= ~_BV(OCIE2A);
+#endif
+    sparkle.bamPlanes = 0;
+    for (unsigned char p=0; p<sparkle.portCount; p++) {
+      sparkle.ports[p].changed = sparkle.ports[p].mask;
+    }
+    sparkle.commit();
+  }
+
+  /**
+   * Show the next bit plane. Returns how many time units to wait before the
+   * next call.
+   */
+  unsigned char tick() {
+    unsigned char b = plane;
+    plane = (b + 1) & 7;
+    for (unsigned char p=0; p<sparkle.portCount; p++) {
+      Sparkle::LedPort &port = sparkle.ports[p];
+      *port.out = (*port.out & ~port.mask) |
+                  ((planes[p][b] ^ port.invert) & port.mask);
+    }
+    return 1 << b;
+  }
+};
+
+#if defined(TIMSK2) && defined(OCIE2A)
+/**
+ * Define the Timer2 interrupt that drives bam. Use once, at file scope.
+ */
+#define SPARKLE_BAM_ISR(bam) \
+  ISR(TIMER2_COMPA_vect) { \
+    OCR2A = (bam).tick() - 1; \
+  }
+#endif
+#endif //SPARKLE_PORT_IO
+
+#endif
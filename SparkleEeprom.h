@@ -0,0 +1,66 @@
+/**
+ * Keep a Sparkle's LED modes in EEPROM across resets, so they come back at
+ * boot without replaying the setup calls (see Sparkle::saveState()).
+ *
+ *   Sparkle sparkle(leds);
+ *
+ *   void setup() {
+ *     if (!SparkleEeprom::load<128>(sparkle, 0)) {
+ *       sparkle.initPins();
+ *       ...   // first boot: set up the modes
+ *       SparkleEeprom::save<128>(sparkle, 0);
+ *     }
+ *   }
+ *
+ * bufferSize is the stack buffer the blob passes through; it must hold
+ * Sparkle::stateSize() bytes. save() only writes the bytes that changed, to
+ * spare the EEPROM. For cores without EEPROM.h, pass saveState() and
+ * loadState() a buffer of your own and keep it in flash.
+ */
+
+#ifndef _SPARKLE_EEPROM_H_
+#define _SPARKLE_EEPROM_H_
+
+#include "Sparkle.h"
+#include <EEPROM.h>
+
+#ifdef __USE_SPARKLE__
+class SparkleEeprom {
+  public:
+  /**
+   * Save sparkle's state at EEPROM address address. Returns false if it
+   * doesn't fit in bufferSize bytes or the EEPROM.
+   */
+  template <unsigned short bufferSize>
+  static bool save(Sparkle &sparkle, int address) {
+    unsigned char blob[bufferSize];
+    unsigned short bytes = sparkle.saveState(blob, bufferSize);
+    if ((bytes == 0) || (address + bytes > (int)EEPROM.length())) {
+      return false;
+    }
+    for (unsigned short i=0; i<bytes; i++) {
+      EEPROM.update(address + i, blob[i]);
+    }
+    return true;
+  }
+
+  /**
+   * Bring back the state saved at EEPROM address address, instead of calling
+   * Sparkle::initPins(). Returns false if there is no matching state there.
+   */
+  template <unsigned short bufferSize>
+  static bool load(Sparkle &sparkle, int address) {
+    unsigned char blob[bufferSize];
+    unsigned short bytes = sparkle.stateSize();
+    if ((bytes > bufferSize) || (address + bytes > (int)EEPROM.length())) {
+      return false;
+    }
+    for (unsigned short i=0; i<bytes; i++) {
+      blob[i] = EEPROM.read(address + i);
+    }
+    return sparkle.loadState(blob, bytes);
+  }
+};
+#endif //__USE_SPARKLE__
+
+#endif
@@ -0,0 +1,344 @@
+/**
+ * Interrupt driven updates for Sparkle, so animations keep running while
+ * loop() is blocked (SD writes, delay(), long prints...).
+ *
+ * Sparkle::update() runs from a timer interrupt. Since the interrupt owns the
+ * LEDs, loop() no longer calls their methods directly: it queues commands
+ * with SparkleIsr's methods instead, and the interrupt carries them out
+ * before its next update. The queue is a single producer, single consumer
+ * ring buffer, so neither side ever disables interrupts for it. A full queue
+ * drops the command and returns false.
+ *
+ * Everything update() calls then runs inside the interrupt too, including a
+ * listener set with Sparkle::setListener(): keep it short, don't use
+ * Serial or delay() from it, and share data with loop() through volatile
+ * variables, e.g. set a flag for loop() to act on.
+ *
+ *   Sparkle sparkle(leds);
+ *   SparkleIsr<16> driver(sparkle);
+ *   SPARKLE_ISR(driver)
+ *
+ *   void setup() {
+ *     sparkle.initPins();
+ *     driver.begin();
+ *   }
+ *
+ *   void loop() {
+ *     driver.startBlink(leds[0], 100, 900);
+ *     ...   // no sparkle.update() here
+ *   }
+ *
+ * Include this header from your sketch only, since it can define the timer
+ * interrupt. On AVR parts, begin() uses the compare A interrupt of Timer0,
+ * which fires once per millis() tick (about 976 times a second at 16MHz) and
+ * leaves millis() alone; pin 6 (OC0A on an Uno) can no longer use
+ * analogWrite(). On other parts, call service() from your own timer
+ * interrupt.
+ */
+
+#ifndef _SPARKLE_ISR_H_
+#define _SPARKLE_ISR_H_
+
+#include "Sparkle.h"
+
+#ifdef __USE_SPARKLE__
+/**
+ * Keep the compiler from moving memory accesses across this point, so a
+ * queued command is complete before it is published.
+ */
+#define SPARKLE_BARRIER() __asm__ __volatile__("" ::: "memory")
+
+/**
+ * capacity is the queue length, a power of two up to 128.
+ */
+template <unsigned char capacity>
+class SparkleIsr {
+  static_assert((capacity > 0) && (capacity <= 128) &&
+                ((capacity & (capacity - 1)) == 0),
+                "SparkleIsr capacity must be a power of two up to 128");
+
+  private:
+  enum Op {
+    TURN_ON,
+    TURN_OFF,
+    ALL_ON,
+    ALL_OFF,
+    COLOR_ON,
+    COLOR_OFF,
+    BLINK,
+    RANDOM_BLINK,
+    TIMER,
+    FADE_LEVELS,
+    PLAY
+  };
+
+  struct Command {
+    unsigned char op;
+    unsigned char low;            // color, or fade's min level
+    unsigned char high;           // fade's max level
+    LedDef *led;
+    const unsigned char *pattern;
+    unsigned short ticks[4];
+  };
+
+  Sparkle &sparkle;
+  Command queue[capacity];
+  volatile unsigned char head;  // written by loop() only
+  volatile unsigned char tail;  // written by the interrupt only
+  unsigned char divider;
+  unsigned char countdown;
+
+  /**
+   * The slot for the next command, or 0 if the queue is full.
+   */
+  Command *slot() {
+    unsigned char h = head;
+    if ((unsigned char)(h - tail) == capacity) {
+      return 0;
+    }
+    return &queue[h & (capacity - 1)];
+  }
+
+  /**
+   * Hand the command in the next slot over to the interrupt.
+   */
+  bool publish() {
+    SPARKLE_BARRIER();
+    head = head + 1;
+    return true;
+  }
+
+  bool push(unsigned char op, LedDef *led, unsigned char low = 0) {
+    Command *c = slot();
+    if (!c) {
+      return false;
+    }
+    c->op = op;
+    c->led = led;
+    c->low = low;
+    return publish();
+  }
+
+  bool push(unsigned char op, LedDef *led, unsigned short a, unsigned short b,
+            unsigned short c2 = 0, unsigned short d = 0) {
+    Command *c = slot();
+    if (!c) {
+      return false;
+    }
+    c->op = op;
+    c->led = led;
+    c->ticks[0] = a;
+    c->ticks[1] = b;
+    c->ticks[2] = c2;
+    c->ticks[3] = d;
+    return publish();
+  }
+
+  /**
+   * Carry out one queued command.
+   */
+  void run(Command &c) {
+    switch (c.op) {
+      case TURN_ON:   c.led->turnOn(); break;
+      case TURN_OFF:  c.led->turnOff(); break;
+      case ALL_ON:    sparkle.allOn(); break;
+      case ALL_OFF:   sparkle.allOff(); break;
+      case COLOR_ON:  sparkle.turnOnAllColor((enum LedColor)c.low); break;
+      case COLOR_OFF: sparkle.turnOffAllColor((enum LedColor)c.low); break;
+#ifdef __LED_BLINK_ENABLED__
+      case BLINK:
+        c.led->setBlink(c.ticks[0], c.ticks[1]);
+        c.led->startBlink();
+        break;
+#endif
+#ifdef __LED_BLINK_RANDOM_ENABLED__
+      case RANDOM_BLINK:
+        c.led->setRandomBlink(c.ticks[0], c.ticks[1], c.ticks[2], c.ticks[3]);
+        c.led->startRandomBlink();
+        break;
+#endif
+#ifdef __LED_TIMED_ENABLED__
+      case TIMER:
+        c.led->setTimer(c.ticks[0]);
+        c.led->startTimer();
+        break;
+#endif
+#ifdef __LED_FADE_ENABLED__
+      case FADE_LEVELS:
+        c.led->setFade(c.low, c.high, c.ticks[0], c.ticks[1]);
+        c.led->startFade();
+        break;
+#endif
+#ifdef __LED_SEQUENCE_ENABLED__
+      case PLAY:
+        c.led->startSequence(c.pattern, c.ticks[0]);
+        break;
+#endif
+      default:
+        break;
+    }
+  }
+
+  public:
+  /**
+   * Constructor. sparkle is the Sparkle to drive from the interrupt.
+   */
+  SparkleIsr(Sparkle &target):
+             sparkle(target),
+             head(0),
+             tail(0),
+             divider(1),
+             countdown(1) {
+  }
+
+  /**
+   * Start the interrupt where supported (call after Sparkle::initPins()).
+   * Sparkle updates on every interruptsPerUpdate'th interrupt.
+   */
+  void begin(unsigned char interruptsPerUpdate = 1) {
+    divider = interruptsPerUpdate?interruptsPerUpdate:1;
+    countdown = divider;
+#if defined(TIMSK0) && defined(OCIE0A)
+    OCR0A = 0x80;
+    TIMSK0 |= _BV(OCIE0A);
+#endif
+  }
+
+  /**
+   * Stop the interrupt. Commands still queued are carried out first, and
+   * loop() may then use the LEDs and Sparkle directly again.
+   */
+  void end() {
+#if defined(TIMSK0) && defined(OCIE0A)
+    TIMSK0 &= ~_BV(OCIE0A);
+#endif
+    divider = 0;
+    service();
+  }
+
+  /**
+   * The interrupt's work: carry out the queued commands, then update Sparkle
+   * if this interrupt is an update one.
+   */
+  void service() {
+    unsigned char t = tail;
+    unsigned char h = head;
+    if (t != h) {
+      while (t != h) {
+        run(queue[t & (capacity - 1)]);
+        t++;
+      }
+      SPARKLE_BARRIER();
+      tail = t;
+    }
+    if (divider && (--countdown == 0)) {
+      countdown = divider;
+      sparkle.update();
+    }
+  }
+
+  /**
+   * Number of commands waiting for the interrupt.
+   */
+  unsigned char pending() {
+    return head - tail;
+  }
+
+  /**
+   * Queue the LED calls of the same names.
+   */
+  bool turnOn(LedDef &led) { return push(TURN_ON, &led); }
+  bool turnOff(LedDef &led) { return push(TURN_OFF, &led); }
+
+  /**
+   * Queue the Sparkle calls of the same names.
+   */
+  bool allOn() { return push(ALL_ON, 0); }
+  bool allOff() { return push(ALL_OFF, 0); }
+  bool turnOnAllColor(enum LedColor color) { return push(COLOR_ON, 0, color); }
+  bool turnOffAllColor(enum LedColor color) { return push(COLOR_OFF, 0, color); }
+
+  /**
+   * Queue setBlink() and startBlink() of the LED.
+   */
+#ifdef __LED_BLINK_ENABLED__
+  bool startBlink(LedDef &led, unsigned short onDuration,
+                  unsigned short offDuration) {
+    return push(BLINK, &led, onDuration, offDuration);
+  }
+#endif
+
+  /**
+   * Queue setRandomBlink() and startRandomBlink() of the LED.
+   */
+#ifdef __LED_BLINK_RANDOM_ENABLED__
+  bool startRandomBlink(LedDef &led, unsigned short minOffDuration,
+                        unsigned short maxOffDuration,
+                        unsigned short minOnDuration,
+                        unsigned short maxOnDuration) {
+    return push(RANDOM_BLINK, &led, minOffDuration, maxOffDuration,
+                minOnDuration, maxOnDuration);
+  }
+#endif
+
+  /**
+   * Queue setTimer() and startTimer() of the LED.
+   */
+#ifdef __LED_TIMED_ENABLED__
+  bool startTimer(LedDef &led, unsigned short duration) {
+    return push(TIMER, &led, duration, 0);
+  }
+#endif
+
+  /**
+   * Queue setFade() and startFade() of the LED.
+   */
+#ifdef __LED_FADE_ENABLED__
+  bool startFade(LedDef &led, unsigned char minLevel, unsigned char maxLevel,
+                 unsigned short upDuration, unsigned short downDuration) {
+    Command *c = slot();
+    if (!c) {
+      return false;
+    }
+    c->op = FADE_LEVELS;
+    c->led = &led;
+    c->low = minLevel;
+    c->high = maxLevel;
+    c->ticks[0] = upDuration;
+    c->ticks[1] = downDuration;
+    return publish();
+  }
+#endif
+
+  /**
+   * Queue startSequence() of the LED.
+   */
+#ifdef __LED_SEQUENCE_ENABLED__
+  bool startSequence(LedDef &led, const unsigned char *pattern,
+                     unsigned short phase = 0) {
+    Command *c = slot();
+    if (!c) {
+      return false;
+    }
+    c->op = PLAY;
+    c->led = &led;
+    c->pattern = pattern;
+    c->ticks[0] = phase;
+    return publish();
+  }
+#endif
+};
+
+#if defined(TIMSK0) && defined(OCIE0A)
+/**
+ * Define the Timer0 compare interrupt that runs driver. Use once, at file
+ * scope.
+ */
+#define SPARKLE_ISR(driver) \
+  ISR(TIMER0_COMPA_vect) { \
+    (driver).service(); \
+  }
+#endif
+#endif //__USE_SPARKLE__
+
+#endif
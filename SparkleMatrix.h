@@ -0,0 +1,210 @@
+/**
+ * Multiplexed and charlieplexed LED matrices for Sparkle.
+ *
+ * Every LED sits between an anode line and a cathode line, where the lines
+ * are up to 8 pins on one port. A refresh step drives one anode line HIGH,
+ * the cathode lines of its lit LEDs LOW, and leaves the other lines as
+ * inputs. That covers charlieplexing (n lines, n*(n-1) LEDs) as well as row
+ * and column multiplexing with the rows as anode lines.
+ *
+ * Sparkle keeps tracking the LEDs as usual (modes, timers, on/off) through a
+ * frame. Whenever the frame changes, the DDR and PORT bytes of every anode
+ * line are worked out once, so each refresh step, run from a timer
+ * interrupt, is just a few register writes.
+ *
+ * The wiring is a PROGMEM table with SPARKLE_WIRE(anode, cathode) per LED, in
+ * the order of the Sparkle's LED list, using line numbers (indexes into the
+ * pin list). The LEDs' own pin numbers are not used; declare them common
+ * cathode.
+ *
+ *   const unsigned char linePins[3] = { 2, 3, 4 };
+ *   const unsigned char wiring[6] PROGMEM = {
+ *     SPARKLE_WIRE(0, 1), SPARKLE_WIRE(1, 0), SPARKLE_WIRE(1, 2),
+ *     SPARKLE_WIRE(2, 1), SPARKLE_WIRE(0, 2), SPARKLE_WIRE(2, 0)
+ *   };
+ *   Sparkle sparkle(leds);
+ *   SparkleMatrix<6, 3> matrix(sparkle, linePins, wiring);
+ *   SPARKLE_MATRIX_ISR(matrix)
+ *
+ *   void setup() {
+ *     matrix.begin(1000);
+ *     sparkle.initPins();
+ *   }
+ *
+ * Include this header from your sketch only, since it can define the timer
+ * interrupt. On AVR parts with Timer1, begin() takes over Timer1 (its PWM
+ * pins and the Servo library stop working). On other parts, call step() from
+ * your own timer interrupt.
+ */
+
+#ifndef _SPARKLE_MATRIX_H_
+#define _SPARKLE_MATRIX_H_
+
+#include "Sparkle.h"
+
+#ifdef SPARKLE_PORT_IO
+/**
+ * One LED's entry in a SparkleMatrix wiring table.
+ */
+#define SPARKLE_WIRE(anode, cathode) ((unsigned char)(((anode) << 4) | (cathode)))
+
+template <unsigned short ledCount, unsigned char lineCount>
+class SparkleMatrix : public SparkleFrame {
+  static_assert((lineCount <= 8 * sizeof(SparklePortMask)) && (lineCount <= 16),
+                "SparkleMatrix lines must fit on one port and in a wiring nibble");
+
+  private:
+  Sparkle &sparkle;
+  const unsigned char *wiring;
+  volatile SparklePortMask *out;
+  volatile SparklePortMask *mode;
+  SparklePortMask lineMask;
+  SparklePortMask lineBit[lineCount];
+  SparklePortMask rowPort[lineCount];
+  SparklePortMask rowDdr[lineCount];
+  unsigned char row;
+  unsigned char buffer[(ledCount + 7) / 8];
+
+  /**
+   * Work out the register bytes of every anode line from the frame.
+   */
+  static void build(SparkleFrame &frame) {
+    SparkleMatrix &matrix = static_cast<SparkleMatrix &>(frame);
+    SparklePortMask ddr[lineCount];
+    for (unsigned char r=0; r<lineCount; r++) {
+      ddr[r] = 0;
+    }
+    for (unsigned short i=0; i<ledCount; i++) {
+      if (matrix.buffer[i >> 3] & (1 << (i & 7))) {
+        unsigned char wire = pgm_read_byte(&matrix.wiring[i]);
+        ddr[wire >> 4] |= matrix.lineBit[wire & 0x0F];
+      }
+    }
+    // step() may interrupt here: keep it from showing a line with one
+    // register byte from each frame.
+    SPARKLE_LOCK();
+    for (unsigned char r=0; r<lineCount; r++) {
+      // Only drive the anode line when something on it is lit; a HIGH input
+      // would turn on its pull-up and make the line glow.
+      if (ddr[r]) {
+        matrix.rowPort[r] = matrix.lineBit[r];
+        matrix.rowDdr[r] = ddr[r] | matrix.lineBit[r];
+      } else {
+        matrix.rowPort[r] = 0;
+        matrix.rowDdr[r] = 0;
+      }
+    }
+    SPARKLE_UNLOCK();
+  }
+
+  public:
+  /**
+   * Constructor. sparkle is the Sparkle whose LEDs are in the matrix, which
+   * may hold up to ledCount LEDs. linePins are the line pins, all on the same
+   * port, and wiring is the PROGMEM wiring table. If the pins are not all on
+   * one port, the matrix drives nothing and begin() doesn't attach it.
+   */
+  SparkleMatrix(Sparkle &target, const unsigned char (&linePins)[lineCount],
+                const unsigned char *ledWiring):
+                sparkle(target),
+                wiring(ledWiring),
+                lineMask(0),
+                row(0) {
+    bits = buffer;
+    size = ledCount;
+    dirty = false;
+    show = build;
+    pixels = 0;
+    memset(channels, 0, sizeof(channels));
+    memset(buffer, 0, sizeof(buffer));
+    unsigned char port = digitalPinToPort(linePins[0]);
+    out = portOutputRegister(port);
+    mode = portModeRegister(port);
+    for (unsigned char r=0; r<lineCount; r++) {
+      lineBit[r] = digitalPinToBitMask(linePins[r]);
+      lineMask |= lineBit[r];
+      rowPort[r] = 0;
+      rowDdr[r] = 0;
+      if ((port == NOT_A_PORT) || (digitalPinToPort(linePins[r]) != port)) {
+        size = 0;
+      }
+    }
+    if (!size) {
+      // Too small for any Sparkle to attach, and step() and end() leave the
+      // registers alone.
+      lineMask = 0;
+    }
+  }
+
+  /**
+   * Attach to the Sparkle and, where supported, start refreshing stepsPerSecond
+   * times a second (so each line is lit stepsPerSecond / lineCount times a
+   * second). Call before Sparkle::initPins(). Rates below what Timer1 can
+   * count, F_CPU / 8 / 65536 (about 31 at 16MHz), and 0, get that slowest
+   * rate.
+   */
+  void begin(unsigned short stepsPerSecond) {
+    sparkle.attach(*this);
+#if defined(TIMSK1) && defined(OCIE1A)
+    unsigned long ticks = (F_CPU / 8) / (stepsPerSecond?stepsPerSecond:1);
+    if (ticks > 65536UL) {
+      ticks = 65536UL;
+    }
+    // CTC mode, clk/8. The 16-bit registers go through the shared TEMP
+    // byte, so no interrupt may come between their two halves.
+    SPARKLE_LOCK();
+    TCCR1A = 0;
+    TCCR1B = _BV(WGM12) | _BV(CS11);
+    TCNT1 = 0;
+    OCR1A = ticks - 1;
+    TIMSK1 |= _BV(OCIE1A);
+    SPARKLE_UNLOCK();
+#else
+    (void)stepsPerSecond;
+#endif
+  }
+
+  /**
+   * Stop refreshing and release the lines.
+   */
+  void end() {
+#if defined(TIMSK1) && defined(OCIE1A)
+    TIMSK1 &= ~_BV(OCIE1A);
+#endif
+    if (!lineMask) {
+      return;
+    }
+    *mode &= ~lineMask;
+    *out &= ~lineMask;
+  }
+
+  /**
+   * Show the next anode line: three register writes. The lines go to inputs
+   * before their levels change, so the LEDs of the last line never see the
+   * levels of the next one.
+   */
+  void step() {
+    if (!lineMask) {
+      return;
+    }
+    unsigned char r = row;
+    row = (r + 1 == lineCount)?0:r + 1;
+    SparklePortMask others = *mode & ~lineMask;
+    *mode = others;
+    *out = (*out & ~lineMask) | rowPort[r];
+    *mode = others | rowDdr[r];
+  }
+};
+
+#if defined(TIMSK1) && defined(OCIE1A)
+/**
+ * Define the Timer1 interrupt that refreshes matrix. Use once, at file scope.
+ */
+#define SPARKLE_MATRIX_ISR(matrix) \
+  ISR(TIMER1_COMPA_vect) { \
+    (matrix).step(); \
+  }
+#endif
+#endif //SPARKLE_PORT_IO
+
+#endif
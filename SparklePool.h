@@ -0,0 +1,140 @@
+/**
+ * A Sparkle with room for up to capacity LEDs that are added and removed at
+ * run time, e.g. for hot-plugged light bars. There is no heap: the LEDs live
+ * in the pool, and removing one moves the last LED into its place, so the
+ * list stays dense and update() is still one linear sweep.
+ *
+ *   SparklePool<300> pool;
+ *
+ *   unsigned short bar = pool.add(LedDef(5, RED, true, false));
+ *   pool.get(bar).setBlink(100, 400);
+ *   pool.get(bar).startBlink();
+ *   ...
+ *   pool.remove(bar);
+ *
+ * add() returns a handle that stays valid until the LED is removed; handles
+ * of removed LEDs are reused. Since LEDs move, references from get() are
+ * only good until the next remove(), and pools can't use frames (as with
+ * SparkleShift) or SparkleGroups, which go by list position.
+ * Led is the LED type, LedDef or RgbLedDef.
+ */
+
+#ifndef _SPARKLE_POOL_H_
+#define _SPARKLE_POOL_H_
+
+#include "Sparkle.h"
+
+#ifdef __USE_SPARKLE__
+template <unsigned short capacity, class Led = LedDef>
+class SparklePool : public Sparkle {
+  private:
+  Led *slots;
+  unsigned short slotOf[capacity];    // handle to list index, or next free
+  unsigned short handleOf[capacity];  // list index to handle
+  unsigned short firstFree;
+  unsigned char storage[capacity * sizeof(Led)]
+    __attribute__((aligned(__alignof__(Led))));
+
+  public:
+  /**
+   * Constructor. The pool starts out empty.
+   */
+  SparklePool():
+              Sparkle(reinterpret_cast<Led *>(storage), sizeof(Led), 0),
+              slots(reinterpret_cast<Led *>(storage)),
+              firstFree(0) {
+    movable = true;
+    for (unsigned short h=0; h<capacity; h++) {
+      slotOf[h] = (h + 1 < capacity)?h + 1:SPARKLE_NO_LED;
+    }
+  }
+
+  /**
+   * Copy led into the pool and set up its pin. Returns its handle, or
+   * SPARKLE_NO_LED if the pool is full.
+   */
+  unsigned short add(const Led &led) {
+    unsigned short h = firstFree;
+    if (h == SPARKLE_NO_LED) {
+      return SPARKLE_NO_LED;
+    }
+    firstFree = slotOf[h];
+    unsigned short i = count;
+    memcpy((void *)&slots[i], (const void *)&led, sizeof(Led));
+    slotOf[h] = i;
+    handleOf[i] = h;
+    count++;
+    linkColor(i);
+    hold();
+#ifdef SPARKLE_PORT_IO
+    groupLed(slots[i]);
+#endif
+    slots[i].initPin();
+    commit();
+    return h;
+  }
+
+  /**
+   * Turn off and remove the LED with the given handle. Returns false if the
+   * handle isn't in use. Its pins are left as they are (off) and no longer
+   * written.
+   */
+  bool remove(unsigned short handle) {
+    if (!contains(handle)) {
+      return false;
+    }
+    unsigned short i = slotOf[handle];
+    unsigned short last = count - 1;
+    hold();
+    slots[i].turnOff();
+#ifdef SPARKLE_PORT_IO
+    ungroupLed(slots[i]);
+#endif
+    unlinkColor(i);
+    if (i != last) {
+      if (eventsPending) {
+        // A queued LED may be the one that moves: look through them all.
+        queued = SPARKLE_EVENT_QUEUE + 1;
+      }
+      unlinkColor(last);
+      memcpy((void *)&slots[i], (const void *)&slots[last], sizeof(Led));
+      handleOf[i] = handleOf[last];
+      slotOf[handleOf[i]] = i;
+      linkColor(i);
+    }
+    count = last;
+    if (cursor >= count) {
+      cursor = 0;
+    }
+    slotOf[handle] = firstFree;
+    firstFree = handle;
+    commit();
+    return true;
+  }
+
+  /**
+   * Whether handle is an LED in the pool.
+   */
+  bool contains(unsigned short handle) {
+    return (handle < capacity) && (slotOf[handle] < count) &&
+           (handleOf[slotOf[handle]] == handle);
+  }
+
+  /**
+   * The LED with the given handle, which must be in use. Good until the next
+   * remove().
+   */
+  Led &get(unsigned short handle) {
+    return slots[slotOf[handle]];
+  }
+
+  /**
+   * Number of LEDs in the pool.
+   */
+  unsigned short size() {
+    return count;
+  }
+};
+#endif //__USE_SPARKLE__
+
+#endif
@@ -0,0 +1,256 @@
+/**
+ * A compact binary command protocol for Sparkle, e.g. for a host PC that sets
+ * LED modes over Serial or I2C.
+ *
+ * parse() reads commands straight out of the caller's receive buffer, with
+ * no copies, and runs each one as a bulk call on a set of LEDs (see
+ * SparkleSelector), all under one hold(): a buffer full of commands changes
+ * any number of LEDs in one write per port.
+ *
+ *   Sparkle sparkle(leds);
+ *   unsigned char rx[64];
+ *   SparkleProtocol remote(sparkle, sizeof(rx));
+ *   unsigned char rxLength = 0;
+ *
+ *   void loop() {
+ *     while (Serial.available() && (rxLength < sizeof(rx))) {
+ *       rx[rxLength++] = Serial.read();
+ *     }
+ *     unsigned char used = remote.parse(rx, rxLength);
+ *     // Keep the start of a command that hasn't all arrived yet.
+ *     memmove(rx, rx + used, rxLength - used);
+ *     rxLength -= used;
+ *     sparkle.update();
+ *   }
+ *
+ * A command is an opcode byte, a selector and the opcode's parameters, with
+ * 16-bit values low byte first.
+ *
+ *   Selector                              Bytes
+ *   SPARKLE_SEL_ALL                       1
+ *   SPARKLE_SEL_LED, index                3
+ *   SPARKLE_SEL_RANGE, first, count       5
+ *   SPARKLE_SEL_COLORS, mask              3   of SPARKLE_COLOR() bits
+ *   SPARKLE_SEL_SET, size, bits...        3 + (size + 7) / 8
+ *
+ *   Opcode                                Parameters
+ *   SPARKLE_CMD_ON, SPARKLE_CMD_OFF       -
+ *   SPARKLE_CMD_BLINK                     on, off (16-bit each)
+ *   SPARKLE_CMD_TIMER                     duration (16-bit)
+ *   SPARKLE_CMD_FADE                      min, max (8-bit), up, down (16-bit)
+ *   SPARKLE_CMD_BRIGHTNESS                level (8-bit); takes no selector
+ *
+ * BLINK, TIMER and FADE set up the selected LEDs and start them. Commands for
+ * modes that aren't compiled in, and unknown opcodes and selectors, are
+ * counted in getErrors() and skipped; an unknown byte is skipped on its own,
+ * so the parser finds the next command again. The cost of a command is fixed,
+ * apart from the selected LEDs' bulk call. A command must fit in the receive
+ * buffer, which bounds the size of a SPARKLE_SEL_SET; a set with more bits
+ * than the Sparkle has LEDs, or one that can't fit, is an error like an
+ * unknown selector, so it can't hold up the commands behind it.
+ */
+
+#ifndef _SPARKLE_PROTOCOL_H_
+#define _SPARKLE_PROTOCOL_H_
+
+#include "Sparkle.h"
+
+#ifdef __USE_SPARKLE__
+#define SPARKLE_CMD_ON          1
+#define SPARKLE_CMD_OFF         2
+#define SPARKLE_CMD_BLINK       3
+#define SPARKLE_CMD_TIMER       4
+#define SPARKLE_CMD_FADE        5
+#define SPARKLE_CMD_BRIGHTNESS  6
+
+#define SPARKLE_SEL_ALL         0
+#define SPARKLE_SEL_LED         1
+#define SPARKLE_SEL_RANGE       2
+#define SPARKLE_SEL_COLORS      3
+#define SPARKLE_SEL_SET         4
+
+class SparkleProtocol {
+  private:
+  Sparkle &sparkle;
+  unsigned short capacity;
+  unsigned short errors;
+
+  /**
+   * The 16-bit value at at, low byte first.
+   */
+  static unsigned short word(const unsigned char *at) {
+    return at[0] | ((unsigned short)at[1] << 8);
+  }
+
+  /**
+   * Parameter bytes of an opcode, or -1 if it is unknown.
+   */
+  static signed char paramBytes(unsigned char op) {
+    switch (op) {
+      case SPARKLE_CMD_ON:
+      case SPARKLE_CMD_OFF:        return 0;
+      case SPARKLE_CMD_BLINK:      return 4;
+      case SPARKLE_CMD_TIMER:      return 2;
+      case SPARKLE_CMD_FADE:       return 6;
+      case SPARKLE_CMD_BRIGHTNESS: return 1;
+      default:                     return -1;
+    }
+  }
+
+  /**
+   * Bytes of the selector at at, given left bytes to look at: 0 if they
+   * don't hold all of it yet, or -1 if it is unknown or a set with more
+   * bytes than the LEDs need.
+   */
+  int selectorBytes(const unsigned char *at, unsigned short left) {
+    switch (at[0]) {
+      case SPARKLE_SEL_ALL:    return 1;
+      case SPARKLE_SEL_LED:    return 3;
+      case SPARKLE_SEL_RANGE:  return 5;
+      case SPARKLE_SEL_COLORS: return 3;
+      case SPARKLE_SEL_SET: {
+        if (left < 3) {
+          return 0;
+        }
+        unsigned short bytes = ((unsigned long)word(at + 1) + 7) / 8;
+        if (bytes > ((unsigned long)sparkle.count + 7) / 8) {
+          return -1;
+        }
+        return 3 + bytes;
+      }
+      default:                 return -1;
+    }
+  }
+
+  /**
+   * The LEDs chosen by the (complete, known) selector at at. A bitset is
+   * used where it lies.
+   */
+  static SparkleSelector selector(const unsigned char *at) {
+    switch (at[0]) {
+      case SPARKLE_SEL_LED:    return SparkleSelector::range(word(at + 1), 1);
+      case SPARKLE_SEL_RANGE:
+        return SparkleSelector::range(word(at + 1), word(at + 3));
+      case SPARKLE_SEL_COLORS: return SparkleSelector::colors(word(at + 1));
+      case SPARKLE_SEL_SET:    return SparkleSelector::set(at + 3, word(at + 1));
+      default:                 return SparkleSelector::range(0, 0xFFFF);
+    }
+  }
+
+  /**
+   * Run the command at at, given left bytes to look at. Returns the bytes it
+   * took, or 0 if they don't hold all of it yet.
+   */
+  unsigned short command(const unsigned char *at, unsigned short left) {
+    signed char params = paramBytes(at[0]);
+    if (params < 0) {
+      errors++;
+      return 1;
+    }
+    if (at[0] == SPARKLE_CMD_BRIGHTNESS) {
+      if (left < 2) {
+        return 0;
+      }
+      sparkle.setBrightness(at[1]);
+      return 2;
+    }
+    if (left < 2) {
+      return 0;
+    }
+    int selected = selectorBytes(at + 1, left - 1);
+    if (selected < 0) {
+      errors++;
+      return 1;
+    }
+    unsigned long size = 1UL + selected + params;
+    if (size > capacity) {
+      // It would never all arrive.
+      errors++;
+      return 1;
+    }
+    if ((selected == 0) || (left < size)) {
+      return 0;
+    }
+    SparkleSelector leds = selector(at + 1);
+    const unsigned char *p = at + 1 + selected;
+    switch (at[0]) {
+      case SPARKLE_CMD_ON:
+        sparkle.turnOn(leds);
+        break;
+
+      case SPARKLE_CMD_OFF:
+        sparkle.turnOff(leds);
+        break;
+
+#ifdef __LED_BLINK_ENABLED__
+      case SPARKLE_CMD_BLINK:
+        sparkle.setBlink(leds, word(p), word(p + 2));
+        sparkle.startBlink(leds);
+        break;
+#endif
+
+#ifdef __LED_TIMED_ENABLED__
+      case SPARKLE_CMD_TIMER:
+        sparkle.setTimer(leds, word(p));
+        sparkle.startTimer(leds);
+        break;
+#endif
+
+#ifdef __LED_FADE_ENABLED__
+      case SPARKLE_CMD_FADE:
+        sparkle.setFade(leds, p[0], p[1], word(p + 2), word(p + 4));
+        sparkle.startFade(leds);
+        break;
+#endif
+
+      default:
+        errors++;
+        break;
+    }
+    (void)p;
+    return size;
+  }
+
+  public:
+  /**
+   * Constructor. sparkle is the Sparkle the commands are for; bufferSize is
+   * the size of the receive buffer parse() is given.
+   */
+  SparkleProtocol(Sparkle &target, unsigned short bufferSize = 0xFFFF):
+                  sparkle(target), capacity(bufferSize), errors(0) {
+  }
+
+  /**
+   * Run the whole commands at the start of the length bytes at data, with
+   * the pin changes held until the last one. Returns the bytes used; the
+   * rest are the start of a command that hasn't all arrived yet, so pass
+   * them again with the bytes that follow.
+   */
+  unsigned short parse(const unsigned char *data, unsigned short length) {
+    unsigned short used = 0;
+    sparkle.hold();
+    while (used < length) {
+      unsigned short took = command(data + used, length - used);
+      if (took == 0) {
+        break;
+      }
+      used += took;
+    }
+    sparkle.commit();
+    return used;
+  }
+
+  /**
+   * Commands and bytes skipped since the last resetErrors().
+   */
+  unsigned short getErrors() {
+    return errors;
+  }
+
+  void resetErrors() {
+    errors = 0;
+  }
+};
+#endif //__USE_SPARKLE__
+
+#endif
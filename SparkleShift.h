@@ -0,0 +1,79 @@
+/**
+ * Shift register output for Sparkle: drive hundreds of LEDs from a chain of
+ * daisy-chained 74HC595s on the hardware SPI pins plus one latch pin.
+ *
+ * LED i of the Sparkle's list is output Qi%8 of register i/8, counting from
+ * the register wired to the MCU; the LEDs' own pin numbers are not used.
+ * Sparkle keeps the outputs in a bit framebuffer and shifts the whole chain
+ * out once per update pass, and only when an output changed.
+ *
+ *   LedDef leds[100] = { ... };
+ *   Sparkle sparkle(leds);
+ *   SparkleShift<100> chain(sparkle, LATCH_PIN);
+ *
+ *   void setup() {
+ *     chain.begin();
+ *     sparkle.initPins();
+ *   }
+ *
+ * The chain is written with blocking byte transfers at up to 8MHz: on AVR
+ * one byte takes 16 cycles on the wire, less than an SPI interrupt would
+ * cost per byte.
+ */
+
+#ifndef _SPARKLE_SHIFT_H_
+#define _SPARKLE_SHIFT_H_
+
+#include "Sparkle.h"
+#include <SPI.h>
+
+template <unsigned short ledCount>
+class SparkleShift : public SparkleFrame {
+  private:
+  Sparkle &sparkle;
+  unsigned char latchPin;
+  unsigned char buffer[(ledCount + 7) / 8];
+
+  /**
+   * Shift the frame out, last register first, and latch it.
+   */
+  static void push(SparkleFrame &frame) {
+    SparkleShift &chain = static_cast<SparkleShift &>(frame);
+    SPI.beginTransaction(SPISettings(8000000, MSBFIRST, SPI_MODE0));
+    digitalWrite(chain.latchPin, LOW);
+    for (unsigned short i=sizeof(chain.buffer); i-- > 0;) {
+      SPI.transfer(chain.buffer[i]);
+    }
+    digitalWrite(chain.latchPin, HIGH);
+    SPI.endTransaction();
+  }
+
+  public:
+  /**
+   * Constructor. sparkle is the Sparkle whose LEDs are on the chain, which
+   * may hold up to ledCount LEDs; latch is the pin wired to the registers' RCLK.
+   */
+  SparkleShift(Sparkle &target, unsigned char latch):
+               sparkle(target),
+               latchPin(latch) {
+    bits = buffer;
+    size = ledCount;
+    dirty = false;
+    show = push;
+    pixels = 0;
+    memset(channels, 0, sizeof(channels));
+    memset(buffer, 0, sizeof(buffer));
+  }
+
+  /**
+   * Start SPI and attach to the Sparkle. Call before Sparkle::initPins().
+   */
+  void begin() {
+    pinMode(latchPin, OUTPUT);
+    digitalWrite(latchPin, HIGH);
+    SPI.begin();
+    sparkle.attach(*this);
+  }
+};
+
+#endif
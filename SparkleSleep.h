@@ -0,0 +1,161 @@
+/**
+ * Low power waiting for Sparkle: sleep until the next LED change is due.
+ *
+ * sleepUntilNextEvent() asks the Sparkle how long until its next scheduled
+ * change and sleeps for about that long, so the MCU wakes roughly once per
+ * LED transition instead of spinning in loop():
+ *
+ *   Sparkle sparkle(leds);
+ *   SparkleSleep sleeper(sparkle);
+ *   SPARKLE_SLEEP_ISR()
+ *
+ *   void setup() {
+ *     sparkle.initPins();
+ *     sleeper.begin();
+ *     ...
+ *   }
+ *
+ *   void loop() {
+ *     sparkle.update();
+ *     sleeper.sleepUntilNextEvent();
+ *   }
+ *
+ * On AVR, waits of 16ms or more power down and wake up from the watchdog
+ * timer, which takes the period closest below the wait (16ms to 8s). Power
+ * down stops millis(), so begin() makes the Sparkle run on
+ * SparkleSleep::clock(), which is millis() plus the time spent powered down.
+ * The watchdog is only accurate to about 10%, and an earlier wakeup (e.g. a
+ * pin interrupt) still counts the whole period. Shorter waits, and all waits
+ * with deep set to false, use idle sleep, which wakes at the next interrupt:
+ * at the latest the next millis() tick. Use idle sleep only while SparkleBam,
+ * SparkleMatrix, SparkleIsr or hardware PWM fades are running, since power
+ * down stops their timers.
+ *
+ * On SAMD, the wait is a plain WFI: the core sleeps until the next interrupt,
+ * at the latest the next SysTick (millis()) tick. Standby would stop SysTick
+ * and so millis(), so there is no deep choice to make there, and
+ * sleepUntilNextEvent() takes no argument off AVR.
+ *
+ * Include this header from your sketch only, since SPARKLE_SLEEP_ISR()
+ * defines the watchdog interrupt.
+ */
+
+#ifndef _SPARKLE_SLEEP_H_
+#define _SPARKLE_SLEEP_H_
+
+#include "Sparkle.h"
+
+#ifdef __USE_SPARKLE__
+#if defined(__AVR__)
+ #include <avr/sleep.h>
+ #include <avr/wdt.h>
+#endif
+
+class SparkleSleep {
+  private:
+  Sparkle &sparkle;
+
+  /**
+   * Ticks spent powered down, shared by all SparkleSleeps.
+   */
+  static unsigned long &slept() {
+    static unsigned long ticks = 0;
+    return ticks;
+  }
+
+#if defined(__AVR__) && defined(WDTCSR)
+  /**
+   * Power down until the watchdog fires after period 0 (16ms) to 9 (8s).
+   */
+  static void powerDown(unsigned char period) {
+    unsigned char prescale = ((period & 8)?_BV(WDP3):0) | (period & 7);
+    cli();
+    wdt_reset();
+    MCUSR &= ~_BV(WDRF);
+    // Timed sequence: interrupt only, no reset.
+    WDTCSR = _BV(WDCE) | _BV(WDE);
+    WDTCSR = _BV(WDIE) | prescale;
+    set_sleep_mode(SLEEP_MODE_PWR_DOWN);
+    sleep_enable();
+    sei();
+    sleep_cpu();
+    sleep_disable();
+    wdt_disable();
+  }
+#endif
+
+  public:
+  /**
+   * Constructor. sparkle is the Sparkle whose deadlines set the wait.
+   */
+  SparkleSleep(Sparkle &target): sparkle(target) {
+  }
+
+  /**
+   * The timebase to run the Sparkle on: millis() plus the time spent
+   * powered down.
+   */
+  static unsigned long clock() {
+    return millis() + slept();
+  }
+
+  /**
+   * Switch the Sparkle to clock(). Call once, after setting up the LEDs.
+   */
+  void begin() {
+    sparkle.setTimebase(clock);
+  }
+
+  /**
+   * Sleep until about when the next LED change is due, or up to 8s if none
+   * is scheduled, after giving the Sparkle its idle() time. Returns at once
+   * if one is due now. On AVR, with deep false, only idle sleep is used.
+   */
+#if defined(__AVR__)
+  void sleepUntilNextEvent(bool deep = true) {
+#else
+  void sleepUntilNextEvent() {
+#endif
+    unsigned long wait = sparkle.nextEventIn();
+    if (wait == 0) {
+      return;
+    }
+    sparkle.idle();
+#if defined(__AVR__)
+    (void)deep;
+#ifdef WDTCSR
+    if (deep && (wait >= 16)) {
+      // Nominal watchdog periods in ms.
+      static const unsigned short periods[10] = {
+        16, 32, 64, 125, 250, 500, 1000, 2000, 4000, 8000
+      };
+      unsigned char p = 0;
+      while ((p < 9) && (periods[p + 1] <= wait)) {
+        p++;
+      }
+      powerDown(p);
+      slept() += periods[p];
+      return;
+    }
+#endif
+    set_sleep_mode(SLEEP_MODE_IDLE);
+    sleep_mode();
+#elif defined(ARDUINO_ARCH_SAMD)
+    __DSB();
+    __WFI();
+#endif
+  }
+};
+
+#if defined(__AVR__) && defined(WDT_vect)
+/**
+ * Define the watchdog interrupt that wakes SparkleSleep. Use once, at file
+ * scope.
+ */
+#define SPARKLE_SLEEP_ISR() EMPTY_INTERRUPT(WDT_vect)
+#else
+#define SPARKLE_SLEEP_ISR()
+#endif
+#endif //__USE_SPARKLE__
+
+#endif
@@ -0,0 +1,197 @@
+/**
+ * Addressable LED strips for Sparkle: WS2812 (NeoPixel) and APA102 (DotStar)
+ * pixels run the same modes as pin driven LEDs (blinks, timers, fades,
+ * sequences, groups) from the same update() pass.
+ *
+ * LED i of the Sparkle's list is pixel i of the strip, counting from the
+ * MCU; the LEDs' own pin numbers are not used. A LedDef shows its LedColor,
+ * an RgbLedDef its own color, either at its current brightness, and every
+ * LED can fade. Sparkle keeps the pixels in a framebuffer and sends the whole
+ * strip once per update pass, and only when a pixel changed.
+ *
+ *   LedDef leds[60] = { ... };
+ *   Sparkle sparkle(leds);
+ *   SparkleWs2812<60> strip(sparkle, DATA_PIN);
+ *
+ *   void setup() {
+ *     strip.begin();
+ *     sparkle.initPins();
+ *   }
+ *
+ * SparkleWs2812 is only available on 16MHz AVR parts. It sends each bit in
+ * exactly 20 cycles with interrupts off, about 30us per pixel, so millis()
+ * falls behind by about the time a show takes beyond its first millisecond
+ * (some 35 pixels); keep long strips on SparkleApa102, or slow their frames
+ * with Sparkle::setFrameInterval(). SparkleApa102 uses the hardware SPI pins
+ * at 8MHz, with blocking byte transfers as in SparkleShift.
+ */
+
+#ifndef _SPARKLE_STRIP_H_
+#define _SPARKLE_STRIP_H_
+
+#include "Sparkle.h"
+#include <SPI.h>
+
+#ifdef __USE_SPARKLE__
+#if defined(__AVR__) && (F_CPU == 16000000L)
+template <unsigned short ledCount>
+class SparkleWs2812 : public SparkleFrame {
+  private:
+  Sparkle &sparkle;
+  unsigned char dataPin;
+  volatile unsigned char *out;
+  unsigned char pinMask;
+  unsigned long lastShow;
+  unsigned char buffer[ledCount * 3];   // green, red, blue
+
+  /**
+   * Send the frame, once the strip has latched the previous one.
+   */
+  static void push(SparkleFrame &frame) {
+    SparkleWs2812 &strip = static_cast<SparkleWs2812 &>(frame);
+    // The strip latches after the line is low for 50us (280us on newer
+    // parts).
+    while ((micros() - strip.lastShow) < 300) {
+    }
+    const unsigned char *ptr = strip.buffer;
+    unsigned short bytes = sizeof(strip.buffer);
+    unsigned char byte = *ptr++;
+    unsigned char bit = 8;
+    unsigned char sreg = SREG;
+    cli();
+    unsigned char hi = *strip.out | strip.pinMask;
+    unsigned char lo = *strip.out & ~strip.pinMask;
+    unsigned char next = lo;
+    // 20 cycles (1.25us) per bit: high for 5 cycles for a 0, 13 for a 1.
+    __asm__ __volatile__(
+      "1:"                        "\n\t"  //      T = 0
+      "st   %a[port], %[hi]"      "\n\t"  // 2    line high, T = 2
+      "sbrc %[byte], 7"           "\n\t"  // 1-2  a 1 bit
+      "mov  %[next], %[hi]"       "\n\t"  // 0-1  stays high, T = 4
+      "dec  %[bit]"               "\n\t"  // 1    T = 5
+      "st   %a[port], %[next]"    "\n\t"  // 2    T = 7
+      "mov  %[next], %[lo]"       "\n\t"  // 1    T = 8
+      "breq 2f"                   "\n\t"  // 1-2  last bit of the byte
+      "rol  %[byte]"              "\n\t"  // 1    T = 10
+      "rjmp .+0"                  "\n\t"  // 2    T = 12
+      "nop"                       "\n\t"  // 1    T = 13
+      "st   %a[port], %[lo]"      "\n\t"  // 2    line low, T = 15
+      "nop"                       "\n\t"  // 1    T = 16
+      "rjmp .+0"                  "\n\t"  // 2    T = 18
+      "rjmp 1b"                   "\n\t"  // 2    T = 20
+      "2:"                        "\n\t"  //      T = 10
+      "ldi  %[bit], 8"            "\n\t"  // 1    T = 11
+      "sbiw %[count], 1"          "\n\t"  // 2    T = 13
+      "st   %a[port], %[lo]"      "\n\t"  // 2    line low, T = 15
+      "breq 3f"                   "\n\t"  // 1-2  that was the last byte
+      "ld   %[byte], %a[ptr]+"    "\n\t"  // 2    T = 18
+      "rjmp 1b"                   "\n\t"  // 2    T = 20
+      "3:"                        "\n"
+      : [byte] "+r" (byte),
+        [bit] "+d" (bit),
+        [next] "+r" (next),
+        [count] "+w" (bytes),
+        [ptr] "+e" (ptr)
+      : [port] "e" (strip.out),
+        [hi] "r" (hi),
+        [lo] "r" (lo)
+      : "memory");
+    SREG = sreg;
+    strip.lastShow = micros();
+  }
+
+  public:
+  /**
+   * Constructor. sparkle is the Sparkle whose LEDs are on the strip, which
+   * may hold up to ledCount LEDs; pin is the strip's data in.
+   */
+  SparkleWs2812(Sparkle &target, unsigned char pin):
+                sparkle(target),
+                dataPin(pin),
+                out(0),
+                pinMask(0),
+                lastShow(0) {
+    bits = 0;
+    size = ledCount;
+    dirty = false;
+    show = push;
+    pixels = buffer;
+    channels[0] = 1;
+    channels[1] = 0;
+    channels[2] = 2;
+    memset(buffer, 0, sizeof(buffer));
+  }
+
+  /**
+   * Set up the data pin and attach to the Sparkle. Call before
+   * Sparkle::initPins().
+   */
+  void begin() {
+    pinMode(dataPin, OUTPUT);
+    digitalWrite(dataPin, LOW);
+    out = portOutputRegister(digitalPinToPort(dataPin));
+    pinMask = digitalPinToBitMask(dataPin);
+    lastShow = micros();
+    sparkle.attach(*this);
+  }
+};
+#endif
+
+template <unsigned short ledCount>
+class SparkleApa102 : public SparkleFrame {
+  private:
+  Sparkle &sparkle;
+  unsigned char buffer[ledCount * 3];   // blue, green, red
+
+  /**
+   * Send the frame: a start frame, each pixel at full global brightness,
+   * then enough clocks to push the data down the whole strip.
+   */
+  static void push(SparkleFrame &frame) {
+    SparkleApa102 &strip = static_cast<SparkleApa102 &>(frame);
+    SPI.beginTransaction(SPISettings(8000000, MSBFIRST, SPI_MODE0));
+    for (unsigned char i=0; i<4; i++) {
+      SPI.transfer(0x00);
+    }
+    for (unsigned short i=0; i<sizeof(strip.buffer); i+=3) {
+      SPI.transfer(0xFF);
+      SPI.transfer(strip.buffer[i]);
+      SPI.transfer(strip.buffer[i + 1]);
+      SPI.transfer(strip.buffer[i + 2]);
+    }
+    // Each pixel delays the data by half a clock.
+    for (unsigned short i=0; i<(ledCount + 15) / 16; i++) {
+      SPI.transfer(0x00);
+    }
+    SPI.endTransaction();
+  }
+
+  public:
+  /**
+   * Constructor. sparkle is the Sparkle whose LEDs are on the strip, which
+   * may hold up to ledCount LEDs. The strip is wired to the hardware SPI
+   * MOSI and SCK pins.
+   */
+  SparkleApa102(Sparkle &target): sparkle(target) {
+    bits = 0;
+    size = ledCount;
+    dirty = false;
+    show = push;
+    pixels = buffer;
+    channels[0] = 2;
+    channels[1] = 1;
+    channels[2] = 0;
+    memset(buffer, 0, sizeof(buffer));
+  }
+
+  /**
+   * Start SPI and attach to the Sparkle. Call before Sparkle::initPins().
+   */
+  void begin() {
+    SPI.begin();
+    sparkle.attach(*this);
+  }
+};
+#endif //__USE_SPARKLE__
+
+#endif
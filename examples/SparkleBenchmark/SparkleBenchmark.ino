@@ -0,0 +1,185 @@
+/**
+ * Benchmark of Sparkle on real hardware.
+ *
+ * Runs BENCH_LEDS LEDs in each display mode, times Sparkle::update() and the
+ * bulk calls with micros(), and prints the average and worst case per call,
+ * the cycles per LED and the free SRAM over Serial at 115200 baud.
+ *
+ * The features are compiled into the library, so to compare feature sets,
+ * build again with another SPARKLE_FEATURES (see Sparkle.h); the report
+ * starts with the set it was built with. FADE is only timed when built in,
+ * which the default set doesn't. Nothing needs to be wired up, but the LED
+ * pins (2 to 13) are driven.
+ */
+
+#include <Sparkle.h>
+
+#define BENCH_LEDS 24
+#define BENCH_ITERATIONS 2000
+
+#define BENCH_PWM(pin) ((pin) == 3 || (pin) == 5 || (pin) == 6 || \
+                        (pin) == 9 || (pin) == 10 || (pin) == 11)
+#define BENCH_LED(i) LedDef(2 + (i) % 12, (enum LedColor)(RED + (i) % 8), \
+                            true, BENCH_PWM(2 + (i) % 12))
+#define BENCH_LED4(i) BENCH_LED(i), BENCH_LED(i + 1), BENCH_LED(i + 2), \
+                      BENCH_LED(i + 3)
+
+LedDef leds[BENCH_LEDS] = {
+  BENCH_LED4(0), BENCH_LED4(4), BENCH_LED4(8),
+  BENCH_LED4(12), BENCH_LED4(16), BENCH_LED4(20)
+};
+Sparkle sparkle(leds);
+
+/**
+ * Bytes between the heap and the stack.
+ */
+int freeRam() {
+#if defined(__AVR__)
+  extern char __heap_start, *__brkval;
+  char top;
+  return &top - (__brkval ? __brkval : &__heap_start);
+#else
+  return -1;
+#endif
+}
+
+/**
+ * Print one result line: average and worst case in microseconds, and the
+ * average in cycles per LED.
+ */
+void report(const __FlashStringHelper *name, unsigned long total,
+            unsigned long worst, unsigned long calls) {
+  unsigned long average = total / calls;
+  Serial.print(name);
+  Serial.print(F(": avg "));
+  Serial.print(average);
+  Serial.print(F("us, worst "));
+  Serial.print(worst);
+  Serial.print(F("us, "));
+  Serial.print((total * (F_CPU / 1000000UL)) / (calls * BENCH_LEDS));
+  Serial.println(F(" cycles/LED"));
+}
+
+/**
+ * Time BENCH_ITERATIONS calls of Sparkle::update() in the current modes.
+ */
+void benchUpdate(const __FlashStringHelper *name) {
+  unsigned long total = 0;
+  unsigned long worst = 0;
+  for (unsigned short i=0; i<BENCH_ITERATIONS; i++) {
+    unsigned long start = micros();
+    sparkle.update();
+    unsigned long took = micros() - start;
+    total += took;
+    if (took > worst) {
+      worst = took;
+    }
+  }
+  report(name, total, worst, BENCH_ITERATIONS);
+}
+
+/**
+ * Time one call of a bulk operation, repeated 100 times.
+ */
+#define BENCH_CALL(name, call) \
+  do { \
+    unsigned long total = 0; \
+    unsigned long worst = 0; \
+    for (unsigned char i=0; i<100; i++) { \
+      unsigned long start = micros(); \
+      call; \
+      unsigned long took = micros() - start; \
+      total += took; \
+      if (took > worst) { \
+        worst = took; \
+      } \
+    } \
+    report(F(name), total, worst, 100); \
+  } while (0)
+
+void printFeatures() {
+  Serial.print(F("Features:"));
+#ifdef __LED_TIMED_ENABLED__
+  Serial.print(F(" TIMED"));
+#endif
+#ifdef __LED_BLINK_ENABLED__
+  Serial.print(F(" BLINK"));
+#endif
+#ifdef __LED_BLINK_RANDOM_ENABLED__
+  Serial.print(F(" BLINK_RANDOM"));
+#endif
+#ifdef __LED_FADE_ENABLED__
+  Serial.print(F(" FADE"));
+#endif
+#ifdef __LED_SEQUENCE_ENABLED__
+  Serial.print(F(" SEQUENCE"));
+#endif
+#ifdef __SPARKLE_GROUP_ENABLED__
+  Serial.print(F(" GROUP"));
+#endif
+#ifdef SPARKLE_PORT_IO
+  Serial.print(F(" PORT_IO"));
+#endif
+  Serial.println();
+  Serial.print(F("LEDs: "));
+  Serial.print(BENCH_LEDS);
+  Serial.print(F(", "));
+  Serial.print(sizeof(LedDef));
+  Serial.print(F(" bytes each; Sparkle: "));
+  Serial.print(sizeof(Sparkle));
+  Serial.println(F(" bytes"));
+}
+
+void setup() {
+  Serial.begin(115200);
+  sparkle.initPins();
+  printFeatures();
+  Serial.print(F("Free SRAM: "));
+  Serial.println(freeRam());
+
+  BENCH_CALL("allOn", sparkle.allOn());
+  BENCH_CALL("allOff", sparkle.allOff());
+  BENCH_CALL("turnOnAllColor", sparkle.turnOnAllColor(RED));
+
+  sparkle.allOff();
+  benchUpdate(F("update MANUAL"));
+
+#ifdef __LED_BLINK_ENABLED__
+  for (unsigned short i=0; i<BENCH_LEDS; i++) {
+    leds[i].setBlink(3 + i % 5, 5 + i % 7);
+    leds[i].startBlink();
+  }
+  benchUpdate(F("update BLINK"));
+#endif
+
+#ifdef __LED_BLINK_RANDOM_ENABLED__
+  sparkle.setRandomly(2, 10, 2, 10);
+  BENCH_CALL("turnOnRandomly", sparkle.turnOnRandomly());
+  benchUpdate(F("update BLINK_RANDOM"));
+#endif
+
+#ifdef __LED_TIMED_ENABLED__
+  for (unsigned short i=0; i<BENCH_LEDS; i++) {
+    leds[i].setTimer(5000);
+    leds[i].startTimer();
+  }
+  benchUpdate(F("update TIMED"));
+#endif
+
+#ifdef __LED_FADE_ENABLED__
+  sparkle.allOff();
+  for (unsigned short i=0; i<BENCH_LEDS; i++) {
+    leds[i].setFade(0, 255, 500, 500);
+    leds[i].startFade();
+  }
+  benchUpdate(F("update FADE"));
+#endif
+
+  sparkle.allOff();
+  Serial.print(F("Free SRAM: "));
+  Serial.println(freeRam());
+  Serial.println(F("Done."));
+}
+
+void loop() {
+}
@@ -0,0 +1,112 @@
+/**
+ * A thin Arduino core for building Sparkle on a desktop machine: a virtual
+ * clock and a pin sink that records every write. Only what Sparkle uses is
+ * here. By default no port registers are defined, so Sparkle drives every LED
+ * through digitalWrite() and each write can be seen.
+ *
+ * Built with SPARKLE_HOST_PORTS, pins SPARKLE_HOST_PORT_PIN and up are also
+ * on fake 8-bit PORT/DDR registers (8 pins to a port, like an AVR), so Sparkle
+ * batches them and the register bytes can be checked instead.
+ */
+
+#ifndef _SPARKLE_HOST_ARDUINO_H_
+#define _SPARKLE_HOST_ARDUINO_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#define HIGH 0x1
+#define LOW  0x0
+
+#define INPUT  0x0
+#define OUTPUT 0x1
+
+#define PROGMEM
+#define pgm_read_byte(addr) (*(const uint8_t *)(addr))
+#define pgm_read_word(addr) (*(const uint16_t *)(addr))
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+unsigned long millis();
+unsigned long micros();
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+void analogWrite(uint8_t pin, int value);
+long random(long max);
+long random(long min, long max);
+void randomSeed(unsigned long seed);
+
+// Host side ///////////////////////////////////////////////////////////////////
+
+#define SPARKLE_HOST_PINS 256
+
+#ifdef SPARKLE_HOST_PORTS
+/**
+ * The first pin on a port register, and the number of ports. Pins below
+ * (and past the ports) are only reached through digitalWrite().
+ */
+#define SPARKLE_HOST_PORT_PIN 200
+#define SPARKLE_HOST_PORT_COUNT 4
+
+/**
+ * The PORT and DDR registers, by port number. Port 0 is NOT_A_PORT.
+ */
+extern volatile uint8_t sparkleHostPort[SPARKLE_HOST_PORT_COUNT + 1];
+extern volatile uint8_t sparkleHostDdr[SPARKLE_HOST_PORT_COUNT + 1];
+
+#define NOT_A_PORT 0
+#define digitalPinToPort(pin) \
+  ((((pin) >= SPARKLE_HOST_PORT_PIN) && \
+    ((pin) < SPARKLE_HOST_PORT_PIN + 8 * SPARKLE_HOST_PORT_COUNT))? \
+   ((pin) - SPARKLE_HOST_PORT_PIN) / 8 + 1:NOT_A_PORT)
+#define digitalPinToBitMask(pin) ((uint8_t)(1 << (((pin) - SPARKLE_HOST_PORT_PIN) & 7)))
+#define portOutputRegister(port) (&sparkleHostPort[port])
+#define portModeRegister(port) (&sparkleHostDdr[port])
+
+/**
+ * The level of a pin as its port register drives it.
+ */
+inline uint8_t sparkleHostPortLevel(uint8_t pin) {
+  return (sparkleHostPort[digitalPinToPort(pin)] & digitalPinToBitMask(pin))?
+         HIGH:LOW;
+}
+#endif
+
+/**
+ * What a pin has been told to do.
+ */
+struct SparkleHostPin {
+  uint8_t mode;
+  uint8_t level;
+  int analog;                   // last analogWrite() value, or -1
+  unsigned long writes;         // digitalWrite() and analogWrite() calls
+  unsigned long edges;          // digitalWrite() calls that changed the level
+};
+
+extern SparkleHostPin sparkleHostPins[SPARKLE_HOST_PINS];
+
+/**
+ * The virtual clock, in microseconds. millis() is this / 1000.
+ */
+extern unsigned long sparkleHostMicros;
+
+/**
+ * Called on every level change of a pin, if set.
+ */
+extern void (*sparkleHostEdge)(uint8_t pin, uint8_t level);
+
+/**
+ * Reset the clock, the pins and random().
+ */
+void sparkleHostReset();
+
+/**
+ * Move the virtual clock on by ms milliseconds.
+ */
+inline void sparkleHostAdvance(unsigned long ms) {
+  sparkleHostMicros += ms * 1000;
+}
+
+#endif
@@ -0,0 +1,100 @@
+/**
+ * The host Arduino core: virtual clock, recording pins and a deterministic
+ * random().
+ */
+
+#include "Arduino.h"
+
+SparkleHostPin sparkleHostPins[SPARKLE_HOST_PINS];
+unsigned long sparkleHostMicros = 0;
+void (*sparkleHostEdge)(uint8_t pin, uint8_t level) = 0;
+#ifdef SPARKLE_HOST_PORTS
+volatile uint8_t sparkleHostPort[SPARKLE_HOST_PORT_COUNT + 1];
+volatile uint8_t sparkleHostDdr[SPARKLE_HOST_PORT_COUNT + 1];
+
+/**
+ * Set or clear a pin's bit in one of its registers, as the real pinMode() and
+ * digitalWrite() do.
+ */
+static void setPortBit(volatile uint8_t *registers, uint8_t pin, bool set) {
+  uint8_t port = digitalPinToPort(pin);
+  if (port != NOT_A_PORT) {
+    if (set) {
+      registers[port] |= digitalPinToBitMask(pin);
+    } else {
+      registers[port] &= ~digitalPinToBitMask(pin);
+    }
+  }
+}
+#endif
+
+static unsigned long randomState = 1;
+
+unsigned long millis() {
+  return sparkleHostMicros / 1000;
+}
+
+unsigned long micros() {
+  return sparkleHostMicros;
+}
+
+void pinMode(uint8_t pin, uint8_t mode) {
+  sparkleHostPins[pin].mode = mode;
+#ifdef SPARKLE_HOST_PORTS
+  setPortBit(sparkleHostDdr, pin, mode == OUTPUT);
+#endif
+}
+
+void digitalWrite(uint8_t pin, uint8_t value) {
+  SparkleHostPin &p = sparkleHostPins[pin];
+  p.writes++;
+  p.analog = -1;
+#ifdef SPARKLE_HOST_PORTS
+  setPortBit(sparkleHostPort, pin, value != LOW);
+#endif
+  if (p.level != value) {
+    p.level = value;
+    p.edges++;
+    if (sparkleHostEdge) {
+      sparkleHostEdge(pin, value);
+    }
+  }
+}
+
+void analogWrite(uint8_t pin, int value) {
+  sparkleHostPins[pin].writes++;
+  sparkleHostPins[pin].analog = value;
+}
+
+long random(long max) {
+  // Park-Miller; plenty for blink durations.
+  randomState = (randomState * 48271UL) % 2147483647UL;
+  return (max > 0)?(long)(randomState % (unsigned long)max):0;
+}
+
+long random(long min, long max) {
+  return (max > min)?min + random(max - min):min;
+}
+
+void randomSeed(unsigned long seed) {
+  randomState = seed?seed:1;
+}
+
+void sparkleHostReset() {
+  sparkleHostMicros = 0;
+  sparkleHostEdge = 0;
+  randomState = 1;
+  for (unsigned short i=0; i<SPARKLE_HOST_PINS; i++) {
+    sparkleHostPins[i].mode = INPUT;
+    sparkleHostPins[i].level = LOW;
+    sparkleHostPins[i].analog = -1;
+    sparkleHostPins[i].writes = 0;
+    sparkleHostPins[i].edges = 0;
+  }
+#ifdef SPARKLE_HOST_PORTS
+  for (unsigned char p=0; p<=SPARKLE_HOST_PORT_COUNT; p++) {
+    sparkleHostPort[p] = 0;
+    sparkleHostDdr[p] = 0;
+  }
+#endif
+}
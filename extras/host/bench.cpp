@@ -0,0 +1,91 @@
+/**
+ * Simulates many LEDs over a long stretch of virtual time and reports the
+ * cost of Sparkle::update() in wall clock time.
+ *
+ *   sparkle_bench [leds] [minutes] [step ms]
+ *
+ * leds is 250, 1000, 2000 (the default) or 4000. The run defaults to an hour
+ * of virtual time, updated every 10ms. A quarter of the LEDs each blink,
+ * blink randomly, run timers and stay MANUAL.
+ */
+
+#include <Sparkle.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <new>
+
+/**
+ * Set up ledCount LEDs and run them. The LEDs are built in static storage,
+ * since LedDef has no default constructor.
+ */
+template <unsigned short ledCount>
+static int bench(unsigned long minutes, unsigned long step) {
+  alignas(LedDef) static unsigned char storage[ledCount * sizeof(LedDef)];
+  LedDef (&leds)[ledCount] = *reinterpret_cast<LedDef (*)[ledCount]>(storage);
+  for (unsigned short i=0; i<ledCount; i++) {
+    new (&leds[i]) LedDef(i % SPARKLE_HOST_PINS,
+                          (enum LedColor)(i % SPARKLE_COLORS), true, false);
+  }
+
+  sparkleHostReset();
+  Sparkle sparkle(leds);
+  sparkle.initPins();
+  sparkle.setRandomly(100, 2000, 100, 2000);
+  for (unsigned short i=0; i<ledCount; i++) {
+    switch (i % 4) {
+      case 0:
+        leds[i].setBlink(100 + i % 900, 200 + i % 700);
+        leds[i].startBlink();
+        break;
+      case 1:
+        leds[i].startRandomBlink();
+        break;
+      case 2:
+        leds[i].setTimer(1000 + i);
+        leds[i].startTimer();
+        break;
+      default:
+        leds[i].turnOn();
+        break;
+    }
+  }
+
+  unsigned long end = minutes * 60000UL;
+  unsigned long passes = 0;
+  std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+  while (millis() < end) {
+    sparkleHostAdvance(step);
+    sparkle.update();
+    passes++;
+  }
+  double ns = std::chrono::duration<double, std::nano>(
+                std::chrono::steady_clock::now() - begin).count();
+
+  unsigned long edges = 0;
+  for (unsigned short i=0; i<SPARKLE_HOST_PINS; i++) {
+    edges += sparkleHostPins[i].edges;
+  }
+  printf("%u LEDs, %lu updates over %lu virtual minutes\n", ledCount, passes,
+         minutes);
+  printf("%.1f ns/update, %.2f ns/LED/update, %lu pin edges\n", ns / passes,
+         ns / ((double)passes * ledCount), edges);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  unsigned long count = (argc > 1)?atol(argv[1]):2000;
+  unsigned long minutes = (argc > 2)?atol(argv[2]):60;
+  unsigned long step = (argc > 3)?atol(argv[3]):10;
+  if (step > 0) {
+    switch (count) {
+      case 250:  return bench<250>(minutes, step);
+      case 1000: return bench<1000>(minutes, step);
+      case 2000: return bench<2000>(minutes, step);
+      case 4000: return bench<4000>(minutes, step);
+    }
+  }
+  fprintf(stderr, "usage: %s [250|1000|2000|4000] [minutes] [step ms]\n",
+          argv[0]);
+  return 2;
+}
@@ -0,0 +1,961 @@
+/**
+ * Checks that LED modes change on exactly the expected ticks, stepping the
+ * virtual clock 1ms at a time, and that Sparkle's other calls (bulk
+ * selections, saved state, the command protocol) do what they say.
+ *
+ * Built against the fake port registers (SPARKLE_HOST_PORTS), the same checks
+ * run, since they use pins off the ports, and the testPort*() ones check the
+ * register bytes of batched pins.
+ */
+
+#include <Sparkle.h>
+#include <SparklePool.h>
+#include <SparkleProtocol.h>
+#ifdef SPARKLE_HOST_PORTS
+#include <SparkleBam.h>
+#include <SparkleMatrix.h>
+#endif
+#include <stdio.h>
+
+static int failures = 0;
+
+#define CHECK(cond, ...) \
+  do { \
+    if (!(cond)) { \
+      printf("FAIL %s:%d: ", __FILE__, __LINE__); \
+      printf(__VA_ARGS__); \
+      printf("\n"); \
+      failures++; \
+    } \
+  } while (0)
+
+/**
+ * Recorded level changes: pin, level and the millis() they happened at.
+ */
+struct Edge {
+  uint8_t pin;
+  uint8_t level;
+  unsigned long time;
+};
+
+static Edge edges[1024];
+static unsigned short edgeCount = 0;
+
+static void record(uint8_t pin, uint8_t level) {
+  if (edgeCount < sizeof(edges) / sizeof(edges[0])) {
+    edges[edgeCount].pin = pin;
+    edges[edgeCount].level = level;
+    edges[edgeCount].time = millis();
+    edgeCount++;
+  }
+}
+
+static void start() {
+  sparkleHostReset();
+  sparkleHostMicros = 1000000UL;        // start at 1000ms
+  edgeCount = 0;
+}
+
+static void run(Sparkle &sparkle, unsigned long until) {
+  while (millis() < until) {
+    sparkleHostAdvance(1);
+    sparkle.update();
+  }
+}
+
+static void testBlink() {
+  start();
+  LedDef leds[2] = { LedDef(2, RED, true, false), LedDef(3, RED, false, false) };
+  Sparkle sparkle(leds);
+  sparkle.initPins();
+  sparkleHostEdge = record;
+  leds[0].setBlink(7, 13);
+  leds[1].setBlink(5, 5);
+  leds[0].startBlink();
+  leds[1].startBlink();
+  run(sparkle, 2000);
+
+  // Common cathode on pin 2 goes HIGH at 1000, LOW 7 ticks later, HIGH 13
+  // ticks after that; common anode pin 3 the other way round, every 5.
+  unsigned long next2 = 1000;
+  unsigned long next3 = 1000;
+  bool on2 = false;
+  bool on3 = false;
+  for (unsigned short i=0; i<edgeCount; i++) {
+    Edge &e = edges[i];
+    if (e.pin == 2) {
+      on2 = !on2;
+      CHECK(e.time == next2, "pin 2 edge at %lu, expected %lu", e.time, next2);
+      CHECK(e.level == (on2?HIGH:LOW), "pin 2 level at %lu", e.time);
+      next2 = e.time + (on2?7:13);
+    } else {
+      on3 = !on3;
+      CHECK(e.time == next3, "pin 3 edge at %lu, expected %lu", e.time, next3);
+      CHECK(e.level == (on3?LOW:HIGH), "pin 3 level at %lu", e.time);
+      next3 = e.time + 5;
+    }
+  }
+  CHECK(sparkleHostPins[2].edges == 1 + 2 * 50, "pin 2 has %lu edges",
+        sparkleHostPins[2].edges);
+  // Plus initPins() driving the common anode pin HIGH.
+  CHECK(sparkleHostPins[3].edges == 1 + 201, "pin 3 has %lu edges",
+        sparkleHostPins[3].edges);
+}
+
+static void testTimed() {
+  start();
+  LedDef leds[1] = { LedDef(4, RED, true, false) };
+  Sparkle sparkle(leds);
+  sparkle.initPins();
+  sparkleHostEdge = record;
+  leds[0].setTimer(250);
+  leds[0].startTimer();
+  run(sparkle, 3000);
+  CHECK(edgeCount == 2, "%u edges", edgeCount);
+  CHECK(edges[0].time == 1000 && edges[0].level == HIGH, "on at %lu",
+        edges[0].time);
+  CHECK(edges[1].time == 1250 && edges[1].level == LOW, "off at %lu",
+        edges[1].time);
+  CHECK(sparkle.nextEventIn() == SPARKLE_NO_EVENT, "still scheduled");
+}
+
+static void testRandomBlink() {
+  start();
+  LedDef leds[1] = { LedDef(5, RED, true, false) };
+  Sparkle sparkle(leds);
+  sparkle.initPins();
+  sparkleHostEdge = record;
+  sparkle.seed(1234);
+  sparkle.setRandomly(10, 40, 20, 60);
+  sparkle.turnOnRandomly();
+  run(sparkle, 11000);
+
+  // Replay the same generator to predict every period.
+  SparkleRandom rng;
+  rng.seed(1234);
+  bool on = rng.between(0, 2);
+  unsigned long at = 1000;
+  unsigned long due = at + (on?rng.between(20, 60):rng.between(10, 40));
+  unsigned short seen = 0;
+  if (on) {
+    CHECK((edgeCount > 0) && (edges[0].time == at), "first edge");
+    seen++;
+  }
+  while (due <= 11000) {
+    on = !on;
+    CHECK(seen < edgeCount, "missing edge at %lu", due);
+    if (seen >= edgeCount) {
+      break;
+    }
+    CHECK(edges[seen].time == due, "edge at %lu, expected %lu",
+          edges[seen].time, due);
+    CHECK(edges[seen].level == (on?HIGH:LOW), "level at %lu", due);
+    seen++;
+    due += on?rng.between(20, 60):rng.between(10, 40);
+  }
+  CHECK(seen == edgeCount, "%u edges, expected %u", edgeCount, seen);
+}
+
+static void testRandomLookahead() {
+  // Values worked out ahead come out as if generated on demand.
+  SparkleRandom plain;
+  SparkleRandom ahead;
+  plain.seed(99);
+  ahead.seed(99);
+  ahead.refill(200);
+  for (unsigned char i=0; i<40; i++) {
+    if (i % 3 == 0) {
+      ahead.refill(i % 5);
+    }
+    CHECK(plain.next() == ahead.next(), "value %u differs", i);
+  }
+  // seed() drops what was worked out ahead.
+  ahead.refill(SPARKLE_RANDOM_AHEAD);
+  plain.seed(7);
+  ahead.seed(7);
+  CHECK(plain.next() == ahead.next(), "lookahead kept over seed()");
+
+  // idle() between passes doesn't change a random blink.
+  start();
+  LedDef idled[1] = { LedDef(16, RED, true, false) };
+  LedDef busied[1] = { LedDef(17, RED, true, false) };
+  Sparkle idler(idled);
+  Sparkle busy(busied);
+  idler.initPins();
+  busy.initPins();
+  sparkleHostEdge = record;
+  idler.seed(4321);
+  busy.seed(4321);
+  idler.setRandomly(10, 40, 20, 60);
+  busy.setRandomly(10, 40, 20, 60);
+  idler.turnOnRandomly();
+  busy.turnOnRandomly();
+  while (millis() < 4000) {
+    sparkleHostAdvance(1);
+    idler.update();
+    idler.idle();
+    busy.update();
+  }
+  CHECK(edgeCount > 100, "%u edges", edgeCount);
+  for (unsigned short i=0; i + 1<edgeCount; i+=2) {
+    CHECK(edges[i].pin == 16 && edges[i + 1].pin == 17 &&
+          edges[i].time == edges[i + 1].time &&
+          edges[i].level == edges[i + 1].level,
+          "idle() changed the pattern at %lu", edges[i].time);
+  }
+}
+
+static void testFade() {
+  start();
+  LedDef leds[1] = { LedDef(14, RED, true, true) };
+  Sparkle sparkle(leds);
+  sparkle.initPins();
+  // One level per tick: 255 ticks up, 255 ticks down.
+  leds[0].setFade(0, 255, 255, 255);
+  leds[0].startFade();
+  CHECK(sparkleHostPins[14].analog == 0, "fade starts at %d",
+        sparkleHostPins[14].analog);
+  // The level is linear, the duty gamma corrected.
+  run(sparkle, 1064);
+  CHECK(sparkleHostPins[14].analog == 5, "duty %d at level 64",
+        sparkleHostPins[14].analog);
+  run(sparkle, 1128);
+  CHECK(sparkleHostPins[14].analog == 37, "duty %d at level 128",
+        sparkleHostPins[14].analog);
+  run(sparkle, 1192);
+  CHECK(sparkleHostPins[14].analog == 115, "duty %d at level 192",
+        sparkleHostPins[14].analog);
+  run(sparkle, 1255);
+  CHECK(sparkleHostPins[14].analog == 255, "duty %d at the top",
+        sparkleHostPins[14].analog);
+  run(sparkle, 1382);
+  CHECK(sparkleHostPins[14].analog == 37, "duty %d on the way down",
+        sparkleHostPins[14].analog);
+  run(sparkle, 1510);
+  CHECK(sparkleHostPins[14].analog == 0, "duty %d at the bottom",
+        sparkleHostPins[14].analog);
+  // Global brightness scales the duty.
+  sparkle.setBrightness(127);
+  run(sparkle, 1765);
+  CHECK(sparkleHostPins[14].analog == 127, "duty %d at half brightness",
+        sparkleHostPins[14].analog);
+}
+
+static void testSequence() {
+  start();
+  LedDef leds[1] = { LedDef(19, RED, true, true) };
+  Sparkle sparkle(leds);
+  sparkle.initPins();
+  static const unsigned char pattern[] PROGMEM = {
+    SPARKLE_RAMP(255, 10), SPARKLE_HOLD(10), SPARKLE_SET(0), SPARKLE_END
+  };
+  // Frames every 4 ticks: the ramp is seen done at 1012, 2 ticks late. The
+  // HOLD still counts from 1010.
+  sparkle.setFrameInterval(4);
+  leds[0].startSequence(pattern);
+  run(sparkle, 1012);
+  CHECK(sparkleHostPins[19].analog == 255, "duty %d at the ramp's end",
+        sparkleHostPins[19].analog);
+  CHECK(sparkle.nextEventIn() == 8, "hold ends in %lu", sparkle.nextEventIn());
+  run(sparkle, 1020);
+  // END settles on plain off, off the PWM timer.
+  CHECK(!leds[0].isOn() && sparkleHostPins[19].analog == -1 &&
+        sparkleHostPins[19].level == LOW, "still held at 1020");
+}
+
+static void testFrameInterval() {
+  start();
+  LedDef leds[1] = { LedDef(15, RED, true, true) };
+  Sparkle sparkle(leds);
+  sparkle.initPins();
+  sparkle.setFrameInterval(16);
+  leds[0].setFade(0, 255, 255, 255);
+  leds[0].startFade();
+  unsigned long writes = sparkleHostPins[15].writes;
+  run(sparkle, 1063);
+  CHECK(sparkleHostPins[15].writes == writes + 3, "%lu writes in 63 ticks",
+        sparkleHostPins[15].writes - writes);
+  // A frame's worth of level at a time.
+  CHECK(sparkleHostPins[15].analog == 2, "duty %d at level 48",
+        sparkleHostPins[15].analog);
+  // Back to every tick, from the next tick on.
+  sparkle.setFrameInterval(1);
+  CHECK(sparkle.nextEventIn() == 0, "next event in %lu",
+        sparkle.nextEventIn());
+  writes = sparkleHostPins[15].writes;
+  run(sparkle, 1073);
+  CHECK(sparkleHostPins[15].writes == writes + 10, "%lu writes in 10 ticks",
+        sparkleHostPins[15].writes - writes);
+}
+
+/**
+ * Bit i set for each lit LED i of leds.
+ */
+static unsigned short lit(LedDef *leds, unsigned char count) {
+  unsigned short bits = 0;
+  for (unsigned char i=0; i<count; i++) {
+    if (leds[i].isOn()) {
+      bits |= 1 << i;
+    }
+  }
+  return bits;
+}
+
+static void testSelectors() {
+  start();
+  LedDef leds[8] = {
+    LedDef(30, RED, true, false), LedDef(31, GREEN, true, false),
+    LedDef(32, BLUE, true, false), LedDef(33, RED, true, false),
+    LedDef(34, GREEN, true, false), LedDef(35, BLUE, true, false),
+    LedDef(36, RED, true, false), LedDef(37, GREEN, true, false)
+  };
+  Sparkle sparkle(leds);
+  sparkle.initPins();
+  sparkle.turnOn(SparkleSelector::range(2, 3));
+  CHECK(lit(leds, 8) == 0x1C, "range lit %02x", lit(leds, 8));
+  // A range running off the end stops at the last LED.
+  sparkle.turnOn(SparkleSelector::range(6, 100));
+  CHECK(lit(leds, 8) == 0xDC, "long range lit %02x", lit(leds, 8));
+  sparkle.turnOff(SparkleSelector::colors(SPARKLE_COLOR(RED) |
+                                          SPARKLE_COLOR(GREEN)));
+  CHECK(lit(leds, 8) == 0x04, "colors left %02x lit", lit(leds, 8));
+  // Bits past the set's size are not LEDs of it.
+  const unsigned char set[1] = { 0xC3 };
+  sparkle.turnOn(SparkleSelector::set(set, 7));
+  CHECK(lit(leds, 8) == 0x47, "set lit %02x", lit(leds, 8));
+  sparkle.allOff();
+
+  // The start calls share one time sample, so the LEDs blink in step.
+  sparkleHostEdge = record;
+  sparkle.setBlink(SparkleSelector::colors(SPARKLE_COLOR(BLUE)), 30, 70);
+  sparkle.startBlink(SparkleSelector::colors(SPARKLE_COLOR(BLUE)));
+  run(sparkle, 1200);
+  CHECK(edgeCount == 10, "%u edges", edgeCount);
+  for (unsigned short i=0; i<edgeCount; i++) {
+    CHECK(edges[i].pin == 32 || edges[i].pin == 35, "pin %u changed",
+          edges[i].pin);
+    CHECK(edges[i].time == edges[i ^ 1].time, "pins out of step at %lu",
+          edges[i].time);
+  }
+  CHECK(edges[6].time == 1130 && edges[6].level == LOW, "last off at %lu",
+        edges[6].time);
+}
+
+static void testUpdateBudget() {
+  start();
+  LedDef leds[6] = {
+    LedDef(50, RED, true, false), LedDef(51, RED, true, false),
+    LedDef(52, RED, true, false), LedDef(53, RED, true, false),
+    LedDef(54, RED, true, false), LedDef(55, RED, true, false)
+  };
+  Sparkle sparkle(leds);
+  sparkle.initPins();
+  // Listed least overdue first, so the order can't come from the list.
+  for (unsigned char i=0; i<6; i++) {
+    leds[i].setTimer(160 - 10 * i);
+    leds[i].startTimer();
+  }
+  sparkleHostAdvance(200);
+  // Two LEDs per call, most overdue first.
+  sparkle.updateBudget(2);
+  CHECK(lit(leds, 6) == 0x0F, "%02x lit after one slice", lit(leds, 6));
+  CHECK(sparkle.nextEventIn() == 0, "rest not due");
+  sparkle.updateBudget(2);
+  CHECK(lit(leds, 6) == 0x03, "%02x lit after two slices", lit(leds, 6));
+  sparkle.updateBudget(2);
+  CHECK(lit(leds, 6) == 0, "%02x lit after three slices", lit(leds, 6));
+  CHECK(sparkle.nextEventIn() == SPARKLE_NO_EVENT, "still scheduled");
+  // Nothing is due: a free call.
+  sparkle.updateBudget(2);
+  CHECK(lit(leds, 6) == 0, "LEDs changed with nothing due");
+}
+
+static void testGroup() {
+  start();
+  LedDef leds[4] = { LedDef(40, RED, true, false), LedDef(41, RED, true, false),
+                     LedDef(42, RED, true, false), LedDef(43, RED, true, false) };
+  Sparkle sparkle(leds);
+  SparkleGroup chase(sparkle, 0, 4);
+  sparkle.initPins();
+  sparkleHostEdge = record;
+  chase.setBlink(40, 60);
+  chase.startBlink(10);
+  run(sparkle, 1299);
+  for (unsigned short i=0; i<edgeCount; i++) {
+    // Member k is on from 10k ticks into each 100 tick period, for 40.
+    unsigned short k = edges[i].pin - 40;
+    unsigned long into = (edges[i].time - 1000 + 100 - 10 * k) % 100;
+    CHECK(into == ((edges[i].level == HIGH)?0:40),
+          "member %u %s at %lu", k, edges[i].level?"on":"off", edges[i].time);
+  }
+  // Three periods of each member.
+  CHECK(edgeCount == 4 * 6, "%u edges", edgeCount);
+
+  // A member given its own mode leaves the group; stop() turns off the rest.
+  leds[1].turnOn();
+  chase.stop();
+  CHECK(lit(leds, 4) == 0x02, "%02x lit after stop()", lit(leds, 4));
+  unsigned short edgesThen = edgeCount;
+  run(sparkle, 1600);
+  CHECK(edgeCount == edgesThen, "stopped group still blinking");
+  CHECK(sparkle.nextEventIn() == SPARKLE_NO_EVENT, "still scheduled");
+}
+
+static void testPool() {
+  start();
+  SparklePool<3> pool;
+  unsigned short a = pool.add(LedDef(60, RED, true, false));
+  unsigned short b = pool.add(LedDef(61, GREEN, true, false));
+  unsigned short c = pool.add(LedDef(62, RED, true, false));
+  CHECK(pool.add(LedDef(63, RED, true, false)) == SPARKLE_NO_LED,
+        "added past capacity");
+  CHECK(pool.size() == 3, "%u LEDs", pool.size());
+  pool.get(a).turnOn();
+  pool.get(c).setTimer(100);
+  pool.get(c).startTimer();
+
+  // Removing a moves c into its place; c's handle and timer carry on.
+  CHECK(pool.remove(a), "remove() failed");
+  CHECK(sparkleHostPins[60].level == LOW, "removed LED left on");
+  CHECK(!pool.contains(a) && !pool.remove(a), "removed handle still in use");
+  CHECK(pool.contains(b) && pool.contains(c), "handles lost");
+  CHECK(pool.size() == 2, "%u LEDs", pool.size());
+  run(pool, 1099);
+  CHECK(pool.get(c).isOn() && sparkleHostPins[62].level == HIGH,
+        "moved timer ran out early");
+  run(pool, 1100);
+  CHECK(!pool.get(c).isOn() && sparkleHostPins[62].level == LOW,
+        "moved timer still on");
+
+  // Handles are reused, and the moved LED is still in its color's list.
+  unsigned short d = pool.add(LedDef(63, RED, true, false));
+  CHECK(d == a, "handle %u, expected %u", d, a);
+  pool.turnOnAllColor(RED);
+  CHECK(sparkleHostPins[62].level == HIGH && sparkleHostPins[63].level == HIGH &&
+        sparkleHostPins[61].level == LOW, "turnOnAllColor() after moves");
+}
+
+static void testHsv() {
+  start();
+  RgbLedDef rgb(20, 21, 22, true, true);
+  rgb.initPin();
+  rgb.turnOn();
+  struct {
+    unsigned char h, s, v, r, g, b;
+  } colors[] = {
+    { 0, 0, 255, 255, 255, 255 },       // white stays white
+    { 0, 0, 128, 128, 128, 128 },       // as does grey
+    { 0, 255, 255, 255, 0, 0 },
+    { 64, 255, 255, 127, 255, 0 },
+    { 128, 255, 255, 0, 255, 255 },
+    { 0, 255, 0, 0, 0, 0 }
+  };
+  for (unsigned char i=0; i<sizeof(colors) / sizeof(colors[0]); i++) {
+    rgb.setHsv(colors[i].h, colors[i].s, colors[i].v);
+    CHECK(sparkleHostPins[20].analog == colors[i].r &&
+          sparkleHostPins[21].analog == colors[i].g &&
+          sparkleHostPins[22].analog == colors[i].b,
+          "hsv %u,%u,%u gave %d,%d,%d", colors[i].h, colors[i].s, colors[i].v,
+          sparkleHostPins[20].analog, sparkleHostPins[21].analog,
+          sparkleHostPins[22].analog);
+  }
+}
+
+static void testSuppressedWrites() {
+  start();
+  LedDef leds[1] = { LedDef(6, RED, true, false) };
+  Sparkle sparkle(leds);
+  sparkle.initPins();
+  unsigned long writes = sparkleHostPins[6].writes;
+  sparkle.allOff();
+  sparkle.allOff();
+  CHECK(sparkleHostPins[6].writes == writes, "redundant off was written");
+  sparkle.allOn();
+  sparkle.allOn();
+  CHECK(sparkleHostPins[6].writes == writes + 1, "%lu writes",
+        sparkleHostPins[6].writes - writes);
+}
+
+static void testReschedule() {
+  start();
+  LedDef leds[2] = { LedDef(8, RED, true, false), LedDef(9, RED, true, false) };
+  Sparkle sparkle(leds);
+  sparkle.initPins();
+  leds[0].setBlink(500, 500);
+  leds[0].startBlink();
+  leds[1].setTimer(1000);
+  leds[1].startTimer();
+  sparkleHostEdge = record;
+  run(sparkle, 1010);
+  // Shorter settings take effect in the running period.
+  leds[0].setBlink(100, 100);
+  CHECK(sparkle.nextEventIn() == 90, "next event in %lu",
+        sparkle.nextEventIn());
+  leds[1].setTimer(200);
+  run(sparkle, 1300);
+  CHECK(edgeCount == 4, "%u edges", edgeCount);
+  CHECK(edges[0].pin == 8 && edges[0].time == 1100, "blink off at %lu",
+        edges[0].time);
+  CHECK(edges[1].pin == 8 && edges[1].time == 1200, "blink on at %lu",
+        edges[1].time);
+  CHECK(edges[2].pin == 9 && edges[2].time == 1200, "timer off at %lu",
+        edges[2].time);
+  CHECK(edges[3].pin == 8 && edges[3].time == 1300, "blink off at %lu",
+        edges[3].time);
+}
+
+static void testSaveState() {
+  start();
+  unsigned char blob[128];
+  unsigned short bytes;
+  {
+    LedDef leds[3] = { LedDef(70, RED, true, false), LedDef(71, RED, true, false),
+                       LedDef(72, RED, false, false) };
+    Sparkle sparkle(leds);
+    sparkle.initPins();
+    leds[0].setBlink(100, 200);
+    leds[0].startBlink();
+    leds[1].setTimer(300);
+    leds[1].startTimer();
+    leds[2].turnOn();
+    CHECK(sparkle.saveState(blob, sparkle.stateSize() - 1) == 0,
+          "saved into a short buffer");
+    bytes = sparkle.saveState(blob, sizeof(blob));
+    CHECK(bytes > 0 && bytes == sparkle.stateSize(), "saved %u bytes", bytes);
+  }
+
+  // A fresh boot, later on: the modes restart their current period.
+  start();
+  sparkleHostMicros = 5000000UL;
+  LedDef leds[3] = { LedDef(70, RED, true, false), LedDef(71, RED, true, false),
+                     LedDef(72, RED, false, false) };
+  Sparkle sparkle(leds);
+  CHECK(!sparkle.loadState(blob, bytes - 1), "loaded a short blob");
+  blob[bytes - 2] ^= 0x01;
+  CHECK(!sparkle.loadState(blob, bytes), "loaded a damaged blob");
+  CHECK(sparkleHostPins[70].writes == 0, "damaged blob changed a pin");
+  blob[bytes - 2] ^= 0x01;
+  LedDef fewer[2] = { LedDef(70, RED, true, false), LedDef(71, RED, true, false) };
+  Sparkle other(fewer);
+  CHECK(!other.loadState(blob, bytes), "loaded another list's blob");
+  CHECK(sparkle.loadState(blob, bytes), "blob rejected");
+  CHECK(leds[0].isOn() && leds[1].isOn() && leds[2].isOn(), "states lost");
+  CHECK(sparkleHostPins[70].mode == OUTPUT && sparkleHostPins[70].level == HIGH &&
+        sparkleHostPins[72].level == LOW, "pins not restored");
+  CHECK(sparkle.nextEventIn() == 100, "next event in %lu",
+        sparkle.nextEventIn());
+  sparkleHostEdge = record;
+  run(sparkle, 5400);
+  CHECK(edgeCount == 4, "%u edges", edgeCount);
+  CHECK(edges[0].pin == 70 && edges[0].time == 5100, "blink off at %lu",
+        edges[0].time);
+  CHECK(edges[2].pin == 71 && edges[2].time == 5300, "timer off at %lu",
+        edges[2].time);
+  CHECK(leds[2].isOn(), "manual LED changed");
+}
+
+/**
+ * Listener of testListener(): counts the events and starts the timer again
+ * when it runs out, up to rearms times.
+ */
+struct Rearm {
+  unsigned short ons;
+  unsigned short offs;
+  unsigned short rearms;
+  unsigned long lastOff;
+};
+
+static void rearm(LedDef &led, bool on, void *context) {
+  Rearm &r = *(Rearm *)context;
+  if (on) {
+    r.ons++;
+    return;
+  }
+  r.offs++;
+  r.lastOff = millis();
+  if (r.rearms > 0) {
+    r.rearms--;
+    led.setTimer(50);
+    led.startTimer();
+  }
+}
+
+static void testListener() {
+  start();
+  LedDef leds[1] = { LedDef(7, RED, true, false) };
+  Sparkle sparkle(leds);
+  sparkle.initPins();
+  Rearm r = { 0, 0, 3, 0 };
+  sparkle.setListener(rearm, &r);
+  leds[0].setTimer(50);
+  leds[0].startTimer();
+  CHECK(r.ons == 1, "%u on events after startTimer()", r.ons);
+  run(sparkle, 1060);
+  // Re-armed from the listener at 1050: on, TIMED and due at 1100.
+  CHECK(leds[0].isOn(), "off after the listener started the timer again");
+  CHECK(sparkle.nextEventIn() == 40, "next event in %lu",
+        sparkle.nextEventIn());
+  run(sparkle, 2000);
+  CHECK(r.offs == 4, "%u off events", r.offs);
+  CHECK(r.ons == 4, "%u on events", r.ons);
+  CHECK(r.lastOff == 1200, "last off at %lu", r.lastOff);
+  CHECK(!leds[0].isOn(), "on at the end");
+  CHECK(sparkle.nextEventIn() == SPARKLE_NO_EVENT, "still scheduled");
+  // No events once the listener is gone.
+  sparkle.setListener(0);
+  leds[0].turnOn();
+  CHECK(r.ons == 4, "event without a listener");
+
+  // A fade turns the LED on once; its levels aren't events.
+  LedDef faded[1] = { LedDef(18, RED, true, true) };
+  Sparkle fader(faded);
+  fader.initPins();
+  Rearm f = { 0, 0, 0, 0 };
+  fader.setListener(rearm, &f);
+  faded[0].setFade(0, 255, 16, 16);
+  faded[0].startFade();
+  CHECK(f.ons == 1 && f.offs == 0, "%u/%u events after startFade()", f.ons,
+        f.offs);
+  run(fader, millis() + 100);
+  faded[0].startFade();
+  CHECK(f.ons == 1 && f.offs == 0, "%u/%u events while fading", f.ons, f.offs);
+  faded[0].turnOff();
+  CHECK(f.offs == 1, "%u off events after turnOff()", f.offs);
+
+  // More changes in one call than the queue holds are all told, once each.
+  static_assert(SPARKLE_EVENT_QUEUE < 12, "the queue holds all changes");
+  LedDef many[12] = {
+    LedDef(110, RED, true, false), LedDef(111, RED, true, false),
+    LedDef(112, RED, true, false), LedDef(113, RED, true, false),
+    LedDef(114, RED, true, false), LedDef(115, RED, true, false),
+    LedDef(116, RED, true, false), LedDef(117, RED, true, false),
+    LedDef(118, RED, true, false), LedDef(119, RED, true, false),
+    LedDef(120, RED, true, false), LedDef(121, RED, true, false)
+  };
+  Sparkle crowd(many);
+  crowd.initPins();
+  Rearm c = { 0, 0, 0, 0 };
+  crowd.setListener(rearm, &c);
+  crowd.allOn();
+  CHECK(c.ons == 12, "%u on events", c.ons);
+  crowd.turnOffAllColor(RED);
+  many[4].turnOn();
+  CHECK(c.offs == 12 && c.ons == 13,
+        "%u/%u events", c.ons, c.offs);
+}
+
+static void testProtocol() {
+  start();
+  LedDef leds[4] = { LedDef(10, RED, true, false), LedDef(11, RED, true, false),
+                     LedDef(12, RED, true, false), LedDef(13, RED, true, true) };
+  Sparkle sparkle(leds);
+  sparkle.initPins();
+  SparkleProtocol remote(sparkle, 16);
+  // LEDs 0 and 2 on, then the start of a BLINK for LED 1.
+  const unsigned char first[] = {
+    SPARKLE_CMD_ON, SPARKLE_SEL_SET, 3, 0, 0x05,
+    SPARKLE_CMD_BLINK, SPARKLE_SEL_LED, 1
+  };
+  CHECK(remote.parse(first, sizeof(first)) == 5, "partial command was used");
+  CHECK(leds[0].isOn() && !leds[1].isOn() && leds[2].isOn() &&
+        !leds[3].isOn(), "SEL_SET chose the wrong LEDs");
+  const unsigned char rest[] = {
+    SPARKLE_CMD_BLINK, SPARKLE_SEL_LED, 1, 0, 100, 0, 200, 0
+  };
+  CHECK(remote.parse(rest, sizeof(rest)) == sizeof(rest), "BLINK not used");
+  CHECK(leds[1].isOn() && sparkle.nextEventIn() == 100, "LED 1 not blinking");
+  CHECK(remote.getErrors() == 0, "%u errors", remote.getErrors());
+
+  // An unknown byte is skipped on its own; TIMER on a range of one LED,
+  // then BRIGHTNESS.
+  const unsigned char more[] = {
+    0x7F, SPARKLE_CMD_TIMER, SPARKLE_SEL_RANGE, 3, 0, 1, 0, 50, 0,
+    SPARKLE_CMD_BRIGHTNESS, 64
+  };
+  CHECK(remote.parse(more, sizeof(more)) == sizeof(more), "TIMER not used");
+  CHECK(remote.getErrors() == 1, "%u errors", remote.getErrors());
+  CHECK(leds[3].isOn(), "TIMER didn't start");
+  run(sparkle, 1050);
+  CHECK(!leds[3].isOn(), "TIMER didn't run out");
+  // A fade's top level, 255 ticks in, comes out at the new brightness.
+  leds[3].setFade(0, 255, 255, 255);
+  leds[3].startFade();
+  run(sparkle, 1305);
+  CHECK(sparkleHostPins[13].analog == 64, "duty %d after BRIGHTNESS 64",
+        sparkleHostPins[13].analog);
+  leds[3].turnOff();
+  remote.resetErrors();
+
+  // A set bigger than the LEDs is skipped, and the OFF behind it still runs.
+  const unsigned char big[] = {
+    SPARKLE_CMD_ON, SPARKLE_SEL_SET, 0xFF, 0xFF, SPARKLE_CMD_OFF, SPARKLE_SEL_ALL
+  };
+  CHECK(remote.parse(big, sizeof(big)) == sizeof(big), "oversized set wedged");
+  CHECK(remote.getErrors() > 0, "oversized set not counted");
+  CHECK(!leds[0].isOn() && !leds[1].isOn() && !leds[2].isOn(),
+        "OFF after the oversized set didn't run");
+
+  // So is a command that can't fit in the receive buffer.
+  SparkleProtocol small(sparkle, 4);
+  const unsigned char tight[] = {
+    SPARKLE_CMD_ON, SPARKLE_SEL_SET, 3, 0, 0x05
+  };
+  CHECK(small.parse(tight, sizeof(tight)) > 0,
+        "command bigger than the buffer wedged");
+  CHECK(small.getErrors() > 0, "command bigger than the buffer not counted");
+  CHECK(!leds[0].isOn(), "command bigger than the buffer ran");
+}
+
+#ifdef SPARKLE_HOST_PORTS
+#define PORT1 sparkleHostPort[1]
+#define PORT2 sparkleHostPort[2]
+#define DDR1 sparkleHostDdr[1]
+
+static void testPortBatch() {
+  start();
+  // Common cathode on bits 0 and 1 of port 1, common anode on bit 2 and on
+  // bit 0 of port 2.
+  LedDef leds[4] = { LedDef(200, RED, true, false), LedDef(201, RED, true, false),
+                     LedDef(202, RED, false, false), LedDef(208, RED, false, false) };
+  Sparkle sparkle(leds);
+  PORT1 = 0x80;                         // a pin that isn't Sparkle's
+  sparkle.initPins();
+  CHECK(DDR1 == 0x07 && sparkleHostDdr[2] == 0x01, "DDR %02x %02x", DDR1,
+        sparkleHostDdr[2]);
+  CHECK(PORT1 == 0x84 && PORT2 == 0x01, "off is %02x %02x", PORT1, PORT2);
+  // Held changes only reach the register on commit().
+  sparkle.hold();
+  leds[0].turnOn();
+  leds[2].turnOn();
+  leds[3].turnOn();
+  CHECK(PORT1 == 0x84 && PORT2 == 0x01, "held write got through: %02x %02x",
+        PORT1, PORT2);
+  sparkle.commit();
+  CHECK(PORT1 == 0x81 && PORT2 == 0x00, "on is %02x %02x", PORT1, PORT2);
+  CHECK(sparkleHostPins[200].writes == 0, "batched pin used digitalWrite()");
+  // Unheld, a change is written straight away.
+  leds[1].turnOn();
+  CHECK(PORT1 == 0x83, "unheld write %02x", PORT1);
+}
+
+static void testPortBam() {
+  start();
+  LedDef leds[2] = { LedDef(200, RED, true, false), LedDef(201, RED, false, false) };
+  Sparkle sparkle(leds);
+  sparkle.initPins();
+  SparkleBam bam(sparkle);
+  bam.begin();
+  sparkle.setBrightness(0xA5);
+  leds[0].turnOn();
+  leds[1].turnOn();
+  // Plane b shows bit b of the duty for 2^b units; common anode inverted.
+  unsigned short units = 0;
+  for (unsigned char b=0; b<8; b++) {
+    unsigned char wait = bam.tick();
+    CHECK(wait == 1 << b, "plane %u shown for %u", b, wait);
+    unsigned char on = (0xA5 >> b) & 1;
+    CHECK(PORT1 == (on?0x01:0x02), "plane %u is %02x", b, PORT1);
+    units += on?wait:0;
+  }
+  CHECK(units == 0xA5, "lit %u units of 255", units);
+  // Handed back, the LEDs are fully on.
+  bam.end();
+  CHECK(PORT1 == 0x01, "after end() %02x", PORT1);
+}
+
+static void testPortMatrix() {
+  start();
+  LedDef leds[6] = {
+    LedDef(100, RED, true, false), LedDef(101, RED, true, false),
+    LedDef(102, RED, true, false), LedDef(103, RED, true, false),
+    LedDef(104, RED, true, false), LedDef(105, RED, true, false)
+  };
+  static const unsigned char linePins[3] = { 216, 217, 218 };
+  static const unsigned char wiring[6] PROGMEM = {
+    SPARKLE_WIRE(0, 1), SPARKLE_WIRE(1, 0), SPARKLE_WIRE(1, 2),
+    SPARKLE_WIRE(2, 1), SPARKLE_WIRE(0, 2), SPARKLE_WIRE(2, 0)
+  };
+  Sparkle sparkle(leds);
+  SparkleMatrix<6, 3> matrix(sparkle, linePins, wiring);
+  matrix.begin(1000);
+  sparkle.initPins();
+  // Bit 7 of port 3 isn't the matrix's.
+  sparkleHostPort[3] = 0x80;
+  sparkleHostDdr[3] = 0x80;
+  leds[0].turnOn();
+  leds[3].turnOn();
+  // Line 0 drives LED 0 (cathode line 1), line 1 nothing, line 2 LED 3.
+  const unsigned char port[3] = { 0x81, 0x80, 0x84 };
+  const unsigned char ddr[3] = { 0x83, 0x80, 0x86 };
+  for (unsigned char i=0; i<6; i++) {
+    matrix.step();
+    CHECK(sparkleHostPort[3] == port[i % 3] && sparkleHostDdr[3] == ddr[i % 3],
+          "line %u is %02x/%02x", i % 3, sparkleHostPort[3], sparkleHostDdr[3]);
+  }
+  CHECK(sparkleHostPins[100].writes == 0, "LED pin written");
+  matrix.end();
+  CHECK(sparkleHostPort[3] == 0x80 && sparkleHostDdr[3] == 0x80,
+        "lines not released: %02x/%02x", sparkleHostPort[3], sparkleHostDdr[3]);
+
+  // Lines on two ports: not attached, and the registers are left alone.
+  static const unsigned char split[3] = { 216, 217, 224 };
+  LedDef plain[1] = { LedDef(106, RED, true, false) };
+  Sparkle direct(plain);
+  SparkleMatrix<6, 3> broken(direct, split, wiring);
+  broken.begin(1000);
+  direct.initPins();
+  plain[0].turnOn();
+  CHECK(sparkleHostPins[106].level == HIGH, "split matrix attached");
+  broken.step();
+  broken.end();
+  CHECK(sparkleHostPort[3] == 0x80 && sparkleHostPort[4] == 0 &&
+        sparkleHostDdr[3] == 0x80 && sparkleHostDdr[4] == 0,
+        "split matrix wrote the registers");
+}
+
+static void testPortChanged() {
+  start();
+  LedDef leds[2] = { LedDef(200, RED, true, false), LedDef(201, RED, true, false) };
+  Sparkle sparkle(leds);
+  sparkle.initPins();
+  leds[0].turnOn();
+  // Something else clears LED 0's bit; committing LED 1 leaves it alone, as
+  // only changed bits are written.
+  PORT1 &= ~0x01;
+  sparkle.hold();
+  leds[1].turnOn();
+  leds[0].turnOn();
+  sparkle.commit();
+  CHECK(PORT1 == 0x02, "unchanged bit rewritten: %02x", PORT1);
+  leds[0].turnOff();
+  leds[0].turnOn();
+  CHECK(PORT1 == 0x03, "changed bit not written: %02x", PORT1);
+}
+
+static void testPortShare() {
+  start();
+  LedDef leds[3] = { LedDef(200, RED, true, false), LedDef(201, RED, true, false),
+                     LedDef(90, RED, true, false) };
+  Sparkle sparkle(leds);
+  sparkle.initPins();
+  sparkle.setFrameInterval(100);
+  sparkle.setMaxLit(1);
+  leds[0].turnOn();
+  leds[1].turnOn();
+  // LED 2 is off the ports and blinks much faster than the frames, so
+  // commits come every 10 ticks; the shown LED still only moves on per frame.
+  leds[2].setBlink(10, 10);
+  leds[2].startBlink();
+  unsigned char shown = PORT1 & 0x03;
+  unsigned short moves = 0;
+  unsigned long last = millis();
+  while (millis() < 2000) {
+    sparkleHostAdvance(1);
+    sparkle.update();
+    unsigned char now = PORT1 & 0x03;
+    CHECK(now == 0x01 || now == 0x02, "%02x shown at %lu", now, millis());
+    if (now != shown) {
+      CHECK(millis() - last == 100, "moved on after %lu ticks at %lu",
+            millis() - last, millis());
+      shown = now;
+      last = millis();
+      moves++;
+    }
+  }
+  CHECK(moves == 10, "moved on %u times", moves);
+  // No limit: both shown again.
+  sparkle.setMaxLit(0);
+  CHECK((PORT1 & 0x03) == 0x03, "%02x shown without a limit", PORT1 & 0x03);
+}
+
+static void testPortPool() {
+  start();
+  SparklePool<3> pool;
+  unsigned short a = pool.add(LedDef(200, RED, false, false));
+  unsigned short b = pool.add(LedDef(201, RED, true, false));
+  pool.get(a).turnOn();
+  CHECK(PORT1 == 0x00, "%02x with the common anode LED on", PORT1);
+  pool.remove(a);
+  CHECK(PORT1 == 0x01, "removed LED left on: %02x", PORT1);
+  // Its pin is someone else's now: whole-port writes leave it alone.
+  PORT1 &= ~0x01;
+  pool.get(b).turnOn();
+  pool.setMaxLit(1);
+  pool.setBrightness(100);
+  pool.get(b).turnOff();
+  CHECK(PORT1 == 0x00, "removed pin written: %02x", PORT1);
+  SparkleBam bam(pool);
+  bam.begin();
+  pool.get(b).turnOn();
+  for (unsigned char i=0; i<8; i++) {
+    bam.tick();
+    CHECK(!(PORT1 & 0x01), "removed pin written by BAM");
+  }
+  bam.end();
+}
+
+static void testPortLoadState() {
+  start();
+  unsigned char blob[128];
+  unsigned short bytes;
+  {
+    LedDef leds[3] = { LedDef(200, RED, true, false), LedDef(201, RED, true, false),
+                       LedDef(202, RED, false, false) };
+    Sparkle sparkle(leds);
+    sparkle.initPins();
+    leds[0].turnOn();
+    leds[2].turnOn();
+    bytes = sparkle.saveState(blob, sizeof(blob));
+  }
+
+  // After a reset: pins are inputs and low, one of port 1's isn't ours.
+  start();
+  sparkleHostPort[1] = 0x80;
+  sparkleHostDdr[1] = 0x80;
+  LedDef leds[3] = { LedDef(200, RED, true, false), LedDef(201, RED, true, false),
+                     LedDef(202, RED, false, false) };
+  Sparkle sparkle(leds);
+  CHECK(sparkle.loadState(blob, bytes), "blob rejected");
+  // Each port's levels and directions in one write, not pin by pin.
+  CHECK(PORT1 == 0x81 && DDR1 == 0x87, "restored %02x/%02x", PORT1, DDR1);
+  CHECK(sparkleHostPins[200].writes == 0 && sparkleHostPins[200].mode == INPUT,
+        "restored through digitalWrite()/pinMode()");
+  leds[1].turnOn();
+  CHECK(PORT1 == 0x83, "%02x after a restore", PORT1);
+}
+#endif
+
+int main() {
+  testBlink();
+  testTimed();
+  testRandomBlink();
+  testRandomLookahead();
+  testFade();
+  testSequence();
+  testFrameInterval();
+  testHsv();
+  testSelectors();
+  testPool();
+  testGroup();
+  testUpdateBudget();
+  testSuppressedWrites();
+  testReschedule();
+  testSaveState();
+  testListener();
+  testProtocol();
+#ifdef SPARKLE_HOST_PORTS
+  testPortBatch();
+  testPortBam();
+  testPortMatrix();
+  testPortChanged();
+  testPortShare();
+  testPortPool();
+  testPortLoadState();
+#endif
+  if (failures) {
+    printf("%d failures\n", failures);
+    return 1;
+  }
+  printf("All timing checks passed\n");
+  return 0;
+}